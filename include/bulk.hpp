@@ -0,0 +1,19 @@
+#ifndef BULK_H
+#define BULK_H
+
+#include "Arduino.h"
+#include <vector>
+#include "message.h"
+
+// max/bulk/set plans one scene's radio traffic as a whole, see README
+#define BULK_DEVICE_CAPACITY 1024 // Merged commands of one device
+#define BULK_FRAME_GAP 200        // Same as the delay after each send in sendMessageFromQueue()
+#define BULK_QUEUED_AIRTIME 1096  // Frames already queued are taken as temperature frames with long preamble
+#define BULK_CREDIT_WINDOWS 4     // Plans needing more credit refills than this are rejected
+#define BULK_MAX_UNKNOWN 8        // Unmatched targets listed in the result
+
+extern std::vector<Message> *bulk_staging;
+
+void bulkSet(byte *payload, unsigned int length);
+
+#endif
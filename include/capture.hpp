@@ -0,0 +1,56 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "Arduino.h"
+#include "CC1101Packet.h"
+
+// Capture record, little endian:
+// magic (1), flags (1), millis (4), rssi in dBm (1), lqi (1), length (1), frame (length), checksum (1)
+// Checksum is the sum of all preceding bytes of the record, so readers can resync on a raw serial stream.
+#define CAPTURE_MAGIC 0xC5
+#define CAPTURE_HEADER_LENGTH 9
+#define CAPTURE_MAX_RECORD_LENGTH (CAPTURE_HEADER_LENGTH + 64 + 1)
+
+// Flags
+#define CAPTURE_RX 0x00
+#define CAPTURE_TX 0x80
+#define CAPTURE_CLOCK 0x40         // Frame is 4 bytes of epoch seconds taken at millis of the record
+#define CAPTURE_LONG_PREAMBLE 0x20 // TX only
+#define CAPTURE_RESULT_MASK 0x07
+
+// Decode result of RX frames
+#define CAPTURE_DECODED 0x00
+#define CAPTURE_BAD_LENGTH 0x01
+#define CAPTURE_IGNORED 0x02
+#define CAPTURE_UNKNOWN_COMMAND 0x03
+
+// Sinks
+#define CAPTURE_OFF 0
+#define CAPTURE_SERIAL 1
+#define CAPTURE_FLASH 2
+#define CAPTURE_MQTT 3
+
+// Flash ring: "MAXC", write offset (4), then CAPTURE_FLASH_SIZE bytes of records
+#define CAPTURE_FILE "/capture.bin"
+#define CAPTURE_FILE_HEADER_LENGTH 8
+#define CAPTURE_FLASH_SIZE 256 * 1024
+#define CAPTURE_OFFSET_PERSIST 16 // Flushes between rewrites of the offset, a reset loses at most this many
+
+#define CAPTURE_BUFFER_SIZE 200 // Fits into one MQTT packet with default PubSubClient buffer
+#define CAPTURE_FLUSH_INTERVAL 10 * 1000
+#define CAPTURE_CLOCK_INTERVAL 60 * 60 * 1000
+
+extern byte captureSink;
+
+void setCaptureSink(byte sink);
+byte stringToCaptureSink(const char *sink);
+const char *captureSinkToString(byte sink);
+void captureFrame(byte flags, const byte *data, byte length, int rssi, byte lqi);
+void captureReceived(CC1101Packet *packet, int rssi, byte result);
+void captureSent(CC1101Packet *packet, bool longPreamble);
+void captureFlush();
+void captureLoop();
+void dumpCapture();
+void dumpCaptureLoop();
+
+#endif
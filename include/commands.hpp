@@ -0,0 +1,51 @@
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "state.h"
+#include "message.h"
+
+#define COMMAND_SLOTS 8
+#define COMMAND_ID_LENGTH 24
+#define COMMAND_NONE 0xFF
+
+// Command types, for latency histograms
+#define COMMAND_TEMPERATURE 0
+#define COMMAND_CONFIG 1
+#define COMMAND_SCHEDULE 2
+#define COMMAND_ASSOCIATE 3
+#define COMMAND_OTHER 4
+#define COMMAND_TYPES 5
+
+// How a frame of a command ended, see commandFrameDone()
+#define FRAME_ACKED 0
+#define FRAME_SENT 1 // Sent without asking for an ACK, so nothing is known about its delivery
+#define FRAME_FAILED 2
+
+#define LATENCY_BUCKETS 8
+#define LATENCY_INTERVAL 5 * 60 * 1000 // Publish histograms at most this often
+
+typedef struct
+{
+  bool used;
+  byte generation; // Bumped on reuse, so frames of an evicted command don't touch the new one
+  char id[COMMAND_ID_LENGTH];
+  byte address[3];
+  byte type;
+  byte pending; // Frames not yet ACKed or given up
+  byte acked;
+  bool transmitted;
+  bool failed;
+  unsigned long received_at;
+} Command;
+
+void beginCommand(state *device, JsonObject root);
+void endCommand();
+void failCommand();
+void tagCommand(Message *message);
+void commandTransmitted(Message *message);
+void commandFrameDone(Message *message, byte outcome);
+void commandsLoop();
+
+#endif
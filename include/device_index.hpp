@@ -0,0 +1,15 @@
+#ifndef DEVICE_INDEX_H
+#define DEVICE_INDEX_H
+
+#include "Arduino.h"
+
+#define DEVICE_INDEX_EMPTY 0xFFFF
+#define DEVICE_INDEX_MIN_CAPACITY 16
+
+void indexDevice(uint16_t position);
+void indexDeviceName(uint16_t position);
+void rebuildDeviceIndex();
+int findDevicePositionByAddress(const byte *address);
+int findDevicePositionByName(const char *name, size_t length);
+
+#endif
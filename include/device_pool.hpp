@@ -0,0 +1,45 @@
+#ifndef DEVICE_POOL_H
+#define DEVICE_POOL_H
+
+#include "Arduino.h"
+#include <vector>
+#include "state.h"
+
+#define DEVICE_CHUNK 8 // Records per slab
+
+typedef uint16_t device_handle;
+
+// Device records in fixed slabs. Growing adds a slab, records never move, so
+// handles (positions) and state pointers stay valid for the bridge's lifetime.
+class DevicePool
+{
+public:
+  state &operator[](device_handle handle)
+  {
+    return chunks[handle / DEVICE_CHUNK][handle % DEVICE_CHUNK];
+  }
+
+  device_handle size() const
+  {
+    return count;
+  }
+
+  size_t capacity() const
+  {
+    return chunks.size() * DEVICE_CHUNK;
+  }
+
+  device_handle add();
+  void reserve(size_t records);
+  int handleOf(const state *device);
+  void save(std::vector<state> &saved);
+  void exchange(std::vector<state> &other);
+
+private:
+  std::vector<state *> chunks;
+  device_handle count = 0;
+};
+
+extern DevicePool states;
+
+#endif
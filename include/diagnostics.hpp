@@ -0,0 +1,9 @@
+#ifndef DIAGNOSTICS_H
+#define DIAGNOSTICS_H
+
+#define DIAGNOSTICS_INTERVAL 10 * 60 * 1000
+
+void publishDiagnostics();
+void diagnosticsLoop();
+
+#endif
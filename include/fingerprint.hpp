@@ -0,0 +1,18 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include "Arduino.h"
+#include "state.h"
+#include "message.h"
+
+uint16_t fingerprint(const byte *data, unsigned int length);
+uint32_t configFingerprint(const byte *data, unsigned int length);
+bool isConfigBlockCurrent(state *device, byte block, uint32_t fingerprint);
+void beginConfigBlock(state *device, byte block);
+void endConfigBlock(uint32_t fingerprint);
+void tagConfigBlock(Message *message);
+void configBlockAcked(Message *message);
+void configBlockFailed(Message *message);
+void forgetConfigBlocks(state *device);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "Arduino.h"
+#include "state.h"
+#include "device_pool.hpp"
+
+// Recent samples per thermostat, 128 bytes each. Every block starts with a full key
+// sample followed by deltas, the oldest block is dropped when all are full.
+#define HISTORY_BLOCKS 4
+#define HISTORY_BLOCK_SIZE 32
+#define HISTORY_KEY_LENGTH 8 // Flags, tick, measured (2), desired, valve, rssi
+#define HISTORY_SAMPLES_MAX (HISTORY_BLOCKS * HISTORY_BLOCK_SIZE / 3) // Smallest delta is flags, tick delta and one field
+#define HISTORY_RSSI_DEADBAND 3 // dBm, smaller changes alone don't take a sample
+
+// Flags of a sample, changed fields of a delta follow as int8 in this order
+#define HISTORY_MEASURED 0x01
+#define HISTORY_DESIRED 0x02
+#define HISTORY_VALVE 0x04
+#define HISTORY_RSSI 0x08
+#define HISTORY_KEY 0x80
+
+typedef struct
+{
+  tick_t tick;
+  int16_t measured; // Tenths
+  int8_t desired;   // Halves
+  int8_t valve;
+  int8_t rssi;
+} history_sample;
+
+typedef struct
+{
+  byte blocks[HISTORY_BLOCKS][HISTORY_BLOCK_SIZE];
+  byte used[HISTORY_BLOCKS]; // Bytes per block
+  byte newest;               // Block being written
+  history_sample last;       // Deltas are taken against it
+} history_ring;
+
+void recordHistory(device_handle handle, int rssi);
+void publishHistory(state *device, byte *payload, unsigned int length);
+void ageHistory();
+size_t historyBytes();
+
+#endif
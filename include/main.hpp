@@ -2,38 +2,46 @@
 #include "MaxCC1101.h"
 #include "CC1101Packet.h"
 #include "state.h"
+#include "device_pool.hpp"
+#include "message.h"
 #include <ArduinoJson.h>
 #include <vector>
+#include <queue>
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 
 void startBurner();
 void stopBurner();
-void setup_wifi();
 void send(CC1101Packet *packet, bool preamble);
 void sendMessageFromQueue();
-void ackMessageInQueue(byte msgcnt);
+void ackMessageInQueue(byte msgcnt, bool accepted);
 void addToQueue(CC1101Packet packet, bool longPreamble, bool waitForAck);
+Message *lastQueuedMessage();
 void rename(byte *payload);
-void setRoom(state *device, String room);
+void nameDevice(state *device, const char *name);
+void setRoom(state *device, const char *room);
 void setGroup(state *device, byte group);
-void setDesiredTemperature(state *device, int mode, float temperature);
-void sendScheduleTo(state *device, byte weekDay, byte *schedule, byte size);
+void setDesiredTemperature(state *device, int mode, temperature_t temperature);
+void sendScheduleTo(state *device, byte weekDay, const byte *schedule, byte size);
 void setSchedule(state *device, String day, JsonObject schedule_config);
 void addAssociation(state *device, byte *address);
 void addLinkPartner(byte *address, byte *to, byte type);
 void sendAssociateBetween(state *device, state *toDevice);
-void associate(state *device, String to);
-void setTemperatureSettings(state *device, float comfort, float eco, float max, float min, float window_open);
+void associate(state *device, const char *to);
+void setTemperatureSettings(state *device, temperature_t comfort, temperature_t eco, temperature_t max, temperature_t min, temperature_t window_open);
+temperature_t jsonToTemperature(JsonVariant value, temperature_t fallback);
 void setDisplayActualTemperatureState(state *device, bool display_actual_temperature);
 void configValveFunctions(state *device, byte decalc_weekday, byte decalc_hour, byte boost_duration, byte boost_valve_position, byte max_valve_setting, byte valve_offset);
 void displayActualTemperature(state *device, bool isEnabled);
 void setAddress(const char *address);
 void setSelf(byte *payload);
 void publishState();
+void buildStateDocument(state *device, JsonDocument &doc);
+bool isStatePublishDue(state *device);
+void markStatePublished(state *device);
 void set(state *device, byte *payload);
-void callback(String topic, byte *payload, unsigned int length);
-void subscribeToDeviceSetTopics();
+void applySet(state *device, JsonObject root);
+void callback(char *topic, byte *payload, unsigned int length);
 void rfinit();
 void ICACHE_RAM_ATTR messageReceivedInterrupt();
 void setup(void);
@@ -48,21 +56,56 @@ void getBytes(byte (&arr)[N], CC1101Packet *packet, unsigned int position);
 void setType(state *device, int type);
 void setMode(state *device, int mode);
 void sendAckTo(byte *address, byte msgcnt);
+void trackSequence(state *device, byte command, byte msgcnt);
+float lossRate(state *device);
 void parseDateTime(CC1101Packet *packet, short offset);
-void syncValvesToWallThermostats();
+bool isFresh(tick_t last_time);
 void sendConfigurationTo(state *device);
 void handle(CC1101Packet *packet);
+state *findDeviceByAddress(byte *address);
+state *findDeviceByName(const char *name, size_t length);
 
 int stringToMode(String mode);
+const char *modeToString(int mode);
+const char *typeToString(int type);
 unsigned int stringToBytes(byte *data, const char *payload, unsigned int length);
 
 int isHeatingNeeded();
+int heatingDemand();
+void markHeatingDirty();
 
 extern bool autocreate;
-extern std::vector<state> states;
 extern byte myAddress[3];
+extern byte msgCounter;
+extern bool config_changed;
+extern std::queue<Message> queue;
+extern unsigned long rx_dropped;
 
 extern WiFiClient espClient;
 extern PubSubClient client;
 
-#define Debug Serial
+// Serial, muted while the serial capture sink writes records to it, see setCaptureSink()
+class DebugSerial : public Print
+{
+public:
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+
+  bool muted = false;
+};
+
+extern DebugSerial debug_serial;
+#define Debug debug_serial
+
+// State is republished when a value moves by at least the deadband, or after the heartbeat anyway
+#define PUBLISH_DEADBAND_TEMPERATURE 2 // Tenths
+#define PUBLISH_DEADBAND_VALVE 2       // Percent
+#define PUBLISH_HEARTBEAT 15 * 60      // Seconds
+
+extern temperature_t publish_deadband_temperature;
+extern byte publish_deadband_valve;
+extern unsigned int publish_heartbeat;
+#define RX_QUEUE_MAX 32 // Received frames waiting for handle()
+
+#define STALE_DURATION 10 * 60 * 1000
+#define STALE_TICKS MILLIS_TO_TICKS(STALE_DURATION)
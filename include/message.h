@@ -1,3 +1,6 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
 #include "CC1101Packet.h"
 
 typedef struct
@@ -8,4 +11,12 @@ typedef struct
   byte msgcnt;
   bool longPreamble;
   bool waitForAck;
+  byte configBlock; // CONFIG_BLOCK_NONE when not carrying device config
+  byte configOwner[3];
+  uint32_t fingerprint;
+  bool completesBlock;
+  byte command; // COMMAND_NONE when not part of a tracked MQTT command
+  byte commandGeneration;
 } Message;
+
+#endif
\ No newline at end of file
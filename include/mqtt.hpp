@@ -1,2 +1,90 @@
-void mqttReconnect();
-void mqttLoop();
\ No newline at end of file
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <Client.h>
+#include "state.h"
+
+#define ROUTE_TABLE_SIZE 32 // Power of two, at least twice the fixed topics
+#define MQTT_TOPIC_MAX 128
+#define PUBLISH_CHUNK 64 // Bytes handed to the socket at once while streaming JSON
+#define DEVICE_TOPIC_LEVELS 3 // Of device names, each one costs a wildcard subscription per device route
+
+// Encoding of telemetry topics, see publishTelemetry()
+#define PAYLOAD_JSON 0
+#define PAYLOAD_MSGPACK 1
+
+// Connection steps, see mqttLoop()
+#define MQTT_WAIT 0 // Backing off
+#define MQTT_RESOLVE 1
+#define MQTT_TCP 2
+#define MQTT_SESSION 3 // CONNECT sent, waiting for CONNACK
+#define MQTT_SUBSCRIBE 4
+#define MQTT_ANNOUNCE 5
+#define MQTT_READY 6
+
+#define MQTT_PORT 1883
+#define MQTT_DNS_TIMEOUT 2000     // ms, polled across passes
+#define MQTT_TCP_TIMEOUT_MIN 10   // ms, the one wait that blocks, doubled after each failed connect
+#define MQTT_TCP_TIMEOUT_MAX 160  // ms
+#define MQTT_CONNACK_TIMEOUT 2000 // ms, polled across passes
+#define MQTT_SOCKET_TIMEOUT 1     // Seconds, PubSubClient's unit, for the rest of a packet once it started arriving
+#define MQTT_SUBSCRIBE_BATCH 4 // Per loop pass
+#define MQTT_BACKOFF_MIN 1000
+#define MQTT_BACKOFF_MAX 60 * 1000
+
+// PubSubClient's socket, muted while PubSubClient::connect() repeats the CONNECT mqttLoop() already sent, so it only
+// picks up the CONNACK waiting in the socket instead of blocking for it
+class MqttTransport : public Client
+{
+public:
+  MqttTransport(Client &client) : client(client) {}
+
+  int connect(IPAddress ip, uint16_t port) override { return client.connect(ip, port); }
+  int connect(const char *host, uint16_t port) override { return client.connect(host, port); }
+  size_t write(uint8_t c) override { return muted ? 1 : client.write(c); }
+  size_t write(const uint8_t *buffer, size_t size) override { return muted ? size : client.write(buffer, size); }
+  int available() override { return client.available(); }
+  int read() override { return client.read(); }
+  int read(uint8_t *buffer, size_t size) override { return client.read(buffer, size); }
+  int peek() override { return client.peek(); }
+  void flush() override { client.flush(); }
+  void stop() override { client.stop(); }
+  uint8_t connected() override { return client.connected(); }
+  operator bool() override { return (bool)client; }
+
+  bool muted = false;
+
+private:
+  Client &client;
+};
+
+extern MqttTransport mqtt_transport;
+
+void setupRouter();
+bool routeMessage(const char *topic, byte *payload, unsigned int length);
+bool isRoutableName(const char *name);
+byte subscriptionCount();
+bool subscribeRoute(byte index);
+void setupMqtt();
+bool isMqttReady();
+void mqttLoop();
+const char *deviceTopic(char *buffer, state *device, const char *suffix);
+bool publishDocument(const char *topic, const JsonDocument &doc, bool retained, byte format);
+bool publishJson(const char *topic, const JsonDocument &doc, bool retained);
+bool publishTelemetry(const char *topic, const JsonDocument &doc, bool retained);
+byte stringToPayloadFormat(const char *format);
+const char *payloadFormatToString(byte format);
+bool publishText(const char *topic, const char *payload, bool retained);
+bool publishTextNow(const char *topic, const char *payload, bool retained);
+bool beginStream(const char *topic, size_t length, bool retained);
+void streamJson(const JsonDocument &doc);
+void streamText(const char *text);
+bool endStream();
+unsigned long publishCount();
+unsigned long publishMicros();
+
+extern byte telemetry_format;
+
+#endif
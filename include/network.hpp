@@ -0,0 +1,19 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include "Arduino.h"
+
+#define WIFI_CHECK_INTERVAL 1000     // ms between supervision passes
+#define WIFI_RETRY_INTERVAL 30 * 1000 // Restart the station when the SDK's own reconnect hasn't managed by then
+
+void setup_wifi();
+bool isWifiUp();
+void wifiLoop();
+void noteNetworkTime(unsigned long us);
+
+extern unsigned long wifi_disconnects;
+unsigned long wifiDisconnectedSeconds();
+extern unsigned long network_us;     // Spent on Wi-Fi, OTA and MQTT upkeep in loop()
+extern unsigned long network_max_us; // Longest single pass of it since the last diagnostics
+
+#endif
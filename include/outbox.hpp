@@ -0,0 +1,40 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include "Arduino.h"
+
+// Publications held while the broker is away, drained in order after reconnect.
+// A newer retained message replaces a queued one for the same topic.
+// Sized at boot for a full set of state and availability messages of the configured devices.
+#define OUTBOX_DEVICE_BYTES 320
+#define OUTBOX_MIN_SIZE 2048
+#define OUTBOX_MAX_SIZE 12288
+#define OUTBOX_DRAIN_BATCH 4     // Messages per drain step
+#define OUTBOX_DRAIN_INTERVAL 50 // ms between drain steps
+
+#define OUTBOX_RETAINED 0x01
+#define OUTBOX_DEAD 0x02 // Superseded, skipped when draining
+
+typedef struct
+{
+  uint16_t length; // Of the whole entry
+  uint16_t payload_length;
+  byte flags;
+  byte topic_length; // Without the NUL that follows the topic
+} outbox_entry;
+
+void setupOutbox(size_t devices);
+bool isOutboxEmpty();
+byte *reserveOutbox(const char *topic, unsigned int length, bool retained);
+bool queueOutbox(const char *topic, const byte *payload, unsigned int length, bool retained);
+void supersedeOutbox(const char *topic);
+void outboxLoop();
+
+extern unsigned long outbox_buffered;
+extern unsigned long outbox_coalesced;
+extern unsigned long outbox_dropped;
+uint16_t outboxCount();
+size_t outboxBytes();
+size_t outboxSize();
+
+#endif
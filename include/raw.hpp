@@ -0,0 +1,24 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include "Arduino.h"
+#include "CC1101Packet.h"
+#include "max.h"
+
+// Batches on max/raw, one line per frame: millis, rx or tx, RSSI in dBm (- when sent) and the frame in hex
+#define RAW_LINE_MAX (10 + 1 + 2 + 1 + 4 + 1 + 2 * (MAX_MORITZ_MSG) + 1 + 1) // Longest frame, with NUL
+#define RAW_BATCH_FRAMES 16 // Defaults, see README
+#define RAW_BATCH_INTERVAL 5 * 1000
+#define RAW_BUFFER_SIZE (RAW_BATCH_FRAMES * RAW_LINE_MAX) // A default batch of the longest frames, streamed past PubSubClient's buffer
+
+extern bool raw_enabled;
+extern byte raw_batch_frames;
+extern unsigned int raw_batch_interval;
+extern unsigned long raw_frames;
+extern unsigned long raw_dropped;
+
+void rawReceived(CC1101Packet *packet, int rssi);
+void rawSent(CC1101Packet *packet);
+void rawLoop();
+
+#endif
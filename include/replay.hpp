@@ -0,0 +1,21 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "Arduino.h"
+#include "CC1101Packet.h"
+
+#define REPLAY_QUEUE_SAMPLES 48
+#define REPLAY_SAMPLE_INTERVAL 60 * 1000  // Virtual ms between queue depth samples, doubles when samples run out
+#define REPLAY_SEND_GAP 200               // Same as the delay after each send in sendMessageFromQueue()
+#define REPLAY_DRAIN_LIMIT 15 * 60 * 1000 // Virtual ms to keep sending queued messages after the last frame
+#define REPLAY_TIMEOUT 60 * 1000          // End replay when the feeder goes away
+
+extern bool replaying;
+extern bool replay_running;
+
+void replay(byte *payload, unsigned int length);
+void replaySent(CC1101Packet *packet, bool longPreamble);
+void endReplay();
+void replayLoop();
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include "Arduino.h"
+#include <vector>
+#include "state.h"
+
+#define ROOM_NO_THERMOSTAT 0xFFFF
+
+typedef struct
+{
+  string_id name;
+  uint16_t wall_thermostat = ROOM_NO_THERMOSTAT; // Position in states, first one wins like before
+  std::vector<uint16_t> valves;                   // Heating thermostats, positions in states
+  bool dirty = true;                              // A member valve changed or went stale since last sync
+} room;
+
+void rebuildRooms();
+void markRoomDirty(state *device);
+state *findWallThermostatOf(state *device);
+void syncValvesToWallThermostats();
+
+extern std::vector<room> rooms;
+
+#endif
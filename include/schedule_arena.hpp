@@ -0,0 +1,32 @@
+#ifndef SCHEDULE_ARENA_H
+#define SCHEDULE_ARENA_H
+
+#include "Arduino.h"
+
+// Day schedules of all devices share one arena, sized at boot from the device count. Identical days are stored once.
+#define SCHEDULE_NONE 0
+#define SCHEDULE_DEVICE_SLOTS 7   // Seven distinct days per device, fewer are used as identical days are shared
+#define SCHEDULE_SPARE_DEVICES 4  // Room for autocreated ones
+#define SCHEDULE_SLOTS_MAX 255    // Ids are one byte
+#define SCHEDULE_POINTS_MAX 13 // Per day, 2 bytes each
+#define DAY_SCHEDULE_LENGTH (SCHEDULE_POINTS_MAX * 2)
+
+typedef uint8_t schedule_id;
+
+typedef struct
+{
+  byte refs; // 0 for free
+  byte size;
+  byte data[DAY_SCHEDULE_LENGTH];
+} schedule_slot;
+
+void setupScheduleArena(size_t devices);
+bool storeDaySchedule(schedule_id *id, const byte *data, byte size);
+const byte *daySchedule(schedule_id id);
+byte dayScheduleSize(schedule_id id);
+void retainDaySchedule(schedule_id id);
+void releaseDaySchedule(schedule_id *id);
+byte scheduleSlotsUsed();
+byte scheduleCapacity();
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "Arduino.h"
+
+// max/snapshot holds every device's state in one retained message, see README
+#define SNAPSHOT_INTERVAL 30 * 1000     // At most this often
+#define SNAPSHOT_SETTLE 10 * 60 * 1000UL // First one waits for every named device to be heard, at most this long
+
+extern bool snapshot_enabled;
+
+void markSnapshotDirty();
+void snapshotLoop();
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef STALE_WHEEL_H
+#define STALE_WHEEL_H
+
+#include "Arduino.h"
+#include "state.h"
+#include "device_pool.hpp"
+
+// One turn covers STALE_TICKS, so every deadline fits in a single level
+#define STALE_WHEEL_SLOTS 64
+#define STALE_NONE 0xFFFF
+
+// Bits of state.fresh, cleared when the wheel finds the timestamp older than STALE_DURATION
+#define FRESH_SEEN 0x01
+#define FRESH_VALVE 0x02
+#define FRESH_DESIRED 0x04
+#define FRESH_MEASURED 0x08
+#define FRESH_FIELDS 0x0F
+#define FRESH_ARMED 0x80 // Queued in the wheel
+
+void refreshDevice(device_handle handle);
+void rebuildStaleWheel();
+void staleLoop();
+void publishAvailability(state *device, bool now = false);
+void publishAvailabilities(bool now = false);
+
+#endif
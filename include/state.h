@@ -3,34 +3,78 @@
 
 #include <vector>
 #include "max.h"
-#define DAY_SCHEDULE_LENGTH 26
+#include "time.hpp"
+#include "string_pool.hpp"
+#include "schedule_arena.hpp"
 
-typedef struct
+#define STATE_FIELDS 8 // Published without deadband, compared as they are
+
+// Config blocks tracked by fingerprint, see fingerprint.hpp
+#define CONFIG_BLOCK_DISPLAY 0
+#define CONFIG_BLOCK_VALVE 1
+#define CONFIG_BLOCK_TEMPERATURES 2
+#define CONFIG_BLOCK_SCHEDULE 3 // One per weekday
+#define CONFIG_BLOCK_ASSOCIATIONS 10
+#define CONFIG_BLOCKS 11
+#define CONFIG_BLOCK_NONE 0xFF
+
+#define ASSOCIATIONS_MAX 8
+
+// Temperatures are fixed point tenths of a degree, no FPU on the ESP8266. Set points are
+// stored in half degrees as sent over the air, measured temperature in tenths.
+typedef int16_t temperature_t;
+#define HALVES_TO_TENTHS(halves) ((halves) == UNDEFINED ? (temperature_t)UNDEFINED : (temperature_t)((halves) * 5))
+#define TENTHS_TO_HALVES(tenths) ((tenths) == UNDEFINED ? (int8_t)UNDEFINED : (int8_t)(((tenths) + 2) / 5))
+#define TENTHS_TO_JSON(tenths) ((tenths) / 10.0) // Only at the JSON boundary
+#define TEMPERATURE_FORMAT "%s%i.%i" // Sign apart, -0.5 has no negative whole degrees
+#define TEMPERATURE_ARGS(tenths) (tenths) < 0 ? "-" : "", abs(tenths) / 10, abs(tenths) % 10
+
+// Packed to keep 50+ devices in the ESP8266 heap, see max/diagnostics for the actual size
+typedef struct state
 {
-  String name = "";
-  String room = "";
   byte address[3] = {0, 0, 0};
-  unsigned long timestamp = millis();
-  float desired_temperature = UNDEFINED;
-  unsigned long desired_temperature_timestamp = millis();
-  float measured_temperature = UNDEFINED;
-  unsigned long measured_temperature_timestamp = millis();
-  int valve_position = UNDEFINED; // -1 for undefined
-  unsigned long valve_timestamp = millis();
-  int mode = UNDEFINED; // -1 for undefined
-  unsigned long mode_timestamp = millis();
-  unsigned long mode_changed_timestamp = millis();
-  int type = UNDEFINED;                       // -1 for undefined, TODO: cleanup
-  int display_actual_temperature = UNDEFINED; // -1 for undefined
-  int is_open = UNDEFINED;                    // -1 for undefined
-  int rf_error = UNDEFINED;                   // -1 for undefined
-  int low_battery = UNDEFINED;                // -1 for undefined
+  string_id name = STRING_NONE; // See string_pool.hpp
+  string_id topic = STRING_NONE; // max/<name>, see nameDevice()
+  string_id room = STRING_NONE;
   byte group = 0;
-  float eco_temperature = 17;
-  float comfort_temperature = 21;
-  float max_temperature = 30.5;
-  float min_temperature = 4.5;
-  float window_open_temperature = 4.5;
+  short room_id = UNDEFINED; // Position in rooms, -1 for none
+
+  // -1 for undefined
+  int8_t type : 4;
+  int8_t mode : 3;
+  int8_t display_actual_temperature : 2;
+  int8_t is_open : 2;
+  int8_t rf_error : 2;
+  int8_t low_battery : 2;
+  int8_t valve_position = UNDEFINED;
+
+  int8_t desired_temperature = UNDEFINED; // Half degrees
+  int16_t measured_temperature = UNDEFINED; // Tenths of a degree
+  int8_t eco_temperature = 17 * 2;
+  int8_t comfort_temperature = 21 * 2;
+  int8_t max_temperature = 30.5 * 2;
+  int8_t min_temperature = 4.5 * 2;
+  int8_t window_open_temperature = 4.5 * 2;
+
+  tick_t timestamp = nowTicks(); // See time.hpp
+  tick_t desired_temperature_timestamp = nowTicks();
+  tick_t measured_temperature_timestamp = nowTicks();
+  tick_t valve_timestamp = nowTicks();
+  tick_t mode_timestamp = nowTicks();
+  unsigned long mode_changed_at = virtualMillis(); // Full resolution, times the end of a boost
+  uint16_t stale_next = 0xFFFF; // Next device in the same stale wheel slot, see stale_wheel.hpp
+
+  int8_t rssi = 0;                 // Of the last frame, dBm
+  int16_t last_msgcnt = UNDEFINED; // -1 for undefined
+  uint16_t frames_received = 0;    // Halved together when full, see trackSequence()
+  uint16_t frames_lost = 0;
+  uint16_t frames_duplicate = 0;
+
+  // Last retained state publish, see isStatePublishDue()
+  tick_t published_at = 0;
+  byte published_fields[STATE_FIELDS] = {0}; // Without deadband, see stateFields(). Name 0 for never published.
+  int16_t published_measured_temperature = UNDEFINED;
+  int8_t published_valve_position = UNDEFINED;
 
   byte decalc_weekday = 0;
   byte decalc_hour = 12;
@@ -39,9 +83,20 @@ typedef struct
   byte max_valve_setting = 100;
   byte valve_offset = 0;
 
-  byte *schedule[7];
-  byte schedule_size[7];
+  schedule_id schedule[7] = {SCHEDULE_NONE}; // See schedule_arena.hpp
+  byte schedule_unstored = 0;                // Days loaded from flash that didn't fit into the arena, kept there as they are
+
+  byte associated_devices[ASSOCIATIONS_MAX][3];
+  byte associations = 0;
+  byte associations_unstored = 0; // Loaded from flash beyond ASSOCIATIONS_MAX, kept there as they are
+  byte fresh = 0; // FRESH_* bits, nothing is fresh until the first frame
+
+  uint32_t config_fingerprint[CONFIG_BLOCKS] = {0}; // Of config last ACKed by the device, 0 for unknown
+  uint16_t config_failed = 0;                        // Blocks with a frame lost since they were queued
 
-  std::vector<byte> associated_devices;
+  // Bitfields can't have default member initializers before C++20
+  state() : type(UNDEFINED), mode(UNDEFINED), display_actual_temperature(UNDEFINED), is_open(UNDEFINED), rf_error(UNDEFINED), low_battery(UNDEFINED)
+  {
+  }
 } state;
 #endif
@@ -0,0 +1,18 @@
+#ifndef STRING_POOL_H
+#define STRING_POOL_H
+
+#include "Arduino.h"
+
+// Device names and rooms live in one buffer, devices keep a one byte id
+#define STRING_NONE 0
+#define STRING_POOL_SLOTS 255
+
+typedef uint8_t string_id;
+
+string_id internString(const char *value);
+const char *pooledString(string_id id);
+void collectStrings();
+size_t stringPoolBytes();
+byte stringPoolCount();
+
+#endif
@@ -1,9 +1,36 @@
-#include <NTP.h>
+#ifndef TIME_H
+#define TIME_H
 
-extern NTP ntp;
+#include <time.h>
+
+#define NTP_SERVER "pool.ntp.org"
+#define TIME_ZONE "CET-1CEST,M3.5.0/2,M10.5.0/3" // Central European Time, summer time from the last Sunday of March to October
 
 void setupTime();
 void printTime();
 
 #define TENYEARS 315360000UL
-bool isTimeSynced();
\ No newline at end of file
+bool isTimeSynced();
+uint32_t nowEpoch(); // UTC
+struct tm localTime();
+const char *formatTime(const char *format);
+
+// Clock of the protocol path, runs ahead of millis() while replaying captures
+unsigned long virtualMillis();
+void setVirtualClock(unsigned long ms);
+void resetVirtualClock();
+
+// Coarse clock for device timestamps, 16-bit stamps span about 12 days
+#define TICK_SHIFT 14 // ~16.4 s
+#define TICK_MASK ((1UL << TICK_SHIFT) - 1)
+#define MILLIS_TO_TICKS(ms) ((ms) >> TICK_SHIFT)
+#define TICK_AGE_MAX 0x4000 // ~3 days, older stamps are pulled up to it, see ageTick()
+#define TICK_AGE_INTERVAL 60 * 60 * 1000
+typedef uint16_t tick_t;
+
+tick_t nowTicks();
+tick_t ticksSince(tick_t stamp);
+unsigned long millisUntilTick(tick_t tick);
+void ageTick(tick_t &stamp);
+
+#endif
@@ -3,6 +3,7 @@
  */
 
 #include "CC1101.h"
+#include "main.hpp"
 
 // default constructor
 CC1101::CC1101()
@@ -181,7 +182,7 @@ uint8_t CC1101::receiveData(CC1101Packet *packet)
 
 	if (MarcState == CC1101_MARCSTATE_RXFIFO_OVERFLOW)
 	{
-		Serial.println("underflow detected");
+		Debug.println("underflow detected");
 
 		writeCommand(CC1101_SIDLE); //idle
 		writeCommand(CC1101_SFRX);	//flush RX buffer
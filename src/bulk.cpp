@@ -0,0 +1,355 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <vector>
+#include <algorithm>
+#include "max.h"
+#include "state.h"
+#include "message.h"
+#include "configuration.h"
+#include "device_pool.hpp"
+#include "string_pool.hpp"
+#include "schedule_arena.hpp"
+#include "mqtt.hpp"
+#include "bulk.hpp"
+#include "main.hpp"
+
+#ifdef CREDIT_15MIN
+extern unsigned long creditMs;
+#endif
+
+// Set while planning, addToQueue() collects frames here instead of the TX queue
+std::vector<Message> *bulk_staging = 0;
+
+typedef struct
+{
+  device_handle handle;
+  temperature_t temperature; // UNDEFINED when the commands don't set one
+  int mode;                  // UNDEFINED when left to applySet()
+  bool grouped;              // Temperature rides on the group addressed frame of another member
+  uint16_t begin;            // Staged frames of this device
+  uint16_t end;
+  unsigned long airtime;
+} bulk_target;
+
+// 1kb/s and a second of preamble to wake the device, same as takeFromCredit()
+unsigned long frameAirtime(const Message *message)
+{
+  return message->packet.length * 8 + (message->longPreamble ? 1000 : 0);
+}
+
+bool isBulkTarget(state *device, JsonObject command)
+{
+  if (command["all"] | false)
+  {
+    return true;
+  }
+
+  const char *name = command["device"];
+  if (name && device->name != STRING_NONE && strcasecmp(pooledString(device->name), name) == 0)
+  {
+    return true;
+  }
+
+  const char *room = command["room"];
+  return room && device->room != STRING_NONE && strcasecmp(pooledString(device->room), room) == 0;
+}
+
+// Later commands win per key, as if they were sent to max/<name>/set one after another
+bool mergeCommands(state *device, JsonArray commands, JsonDocument &merged)
+{
+  merged.clear();
+  JsonObject root = merged.to<JsonObject>();
+  for (JsonObject command : commands)
+  {
+    if (!isBulkTarget(device, command))
+    {
+      continue;
+    }
+
+    for (JsonPair p : command)
+    {
+      JsonString key = p.key();
+      if (key == "device" || key == "room" || key == "all")
+      {
+        continue;
+      }
+      root[key.c_str()] = p.value();
+    }
+  }
+
+  return root.size() > 0;
+}
+
+// The temperature applySet() will send, a mode alone keeps the device's desired temperature
+void readTemperature(state *device, bulk_target *target, JsonObject root)
+{
+  target->temperature = UNDEFINED;
+  target->mode = UNDEFINED;
+
+  // Group id changes on the way, the old group can't be addressed
+  if (root.containsKey("group"))
+  {
+    return;
+  }
+
+  target->temperature = jsonToTemperature(root.containsKey("temperature") ? root["temperature"] : root["desired_temperature"], UNDEFINED);
+  if (root.containsKey("mode"))
+  {
+    target->mode = stringToMode(root["mode"]);
+    if (target->temperature == UNDEFINED && device->desired_temperature != UNDEFINED)
+    {
+      target->temperature = HALVES_TO_TENTHS(device->desired_temperature);
+    }
+  }
+}
+
+bulk_target *findTarget(std::vector<bulk_target> &targets, device_handle handle)
+{
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    if (targets[i].handle == handle)
+    {
+      return &targets[i];
+    }
+  }
+
+  return 0;
+}
+
+// Group members apply temperature frames carrying their group id, so when the whole group gets the same one, a
+// single frame to one member does. The wall thermostat is preferred, it keeps the valves in sync anyway.
+byte planGroups(std::vector<bulk_target> &targets)
+{
+  byte groupFrames = 0;
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    const bulk_target *first = &targets[i];
+    const byte group = states[first->handle].group;
+    if (group == 0 || first->temperature == UNDEFINED)
+    {
+      continue;
+    }
+
+    bool planned = false;
+    for (size_t j = 0; j < i && !planned; j++)
+    {
+      planned = states[targets[j].handle].group == group;
+    }
+    if (planned)
+    {
+      continue;
+    }
+
+    bulk_target *leader = &targets[i];
+    byte members = 0;
+    bool whole = true;
+    for (device_handle handle = 0; handle < states.size() && whole; handle++)
+    {
+      state *device = &states[handle];
+      if (device->group != group)
+      {
+        continue;
+      }
+
+      bulk_target *member = findTarget(targets, handle);
+      whole = member && member->temperature == first->temperature && member->mode == first->mode;
+      if (whole && device->type == DEVICE_WALL_THERMOSTAT && states[leader->handle].type != DEVICE_WALL_THERMOSTAT)
+      {
+        leader = member;
+      }
+      members++;
+    }
+
+    if (!whole || members < 2)
+    {
+      continue;
+    }
+
+    for (size_t j = 0; j < targets.size(); j++)
+    {
+      if (&targets[j] != leader && states[targets[j].handle].group == group)
+      {
+        targets[j].grouped = true;
+      }
+    }
+    groupFrames++;
+  }
+
+  return groupFrames;
+}
+
+bool cheaperToWake(const bulk_target &a, const bulk_target &b)
+{
+  return a.airtime < b.airtime;
+}
+
+// {"id":"night","commands":[{"room":"bedroom","mode":"manual","temperature":17},{"device":"office/heater",...}]}
+void bulkSet(byte *payload, unsigned int length)
+{
+  // Strings stay in the payload buffer, only the tree needs room
+  DynamicJsonDocument doc(length * 2 + JSON_OBJECT_SIZE(4));
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error)
+  {
+    Debug.print("Bulk set deserializeJson() failed: ");
+    Debug.println(error.c_str());
+    return;
+  }
+
+  JsonArray commands = doc.is<JsonArray>() ? doc.as<JsonArray>() : doc["commands"].as<JsonArray>();
+  const char *id = doc["id"] | "";
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(12) + JSON_ARRAY_SIZE(BULK_MAX_UNKNOWN)> report;
+  report["id"] = id;
+  JsonArray unknown = report.createNestedArray("unknown");
+  for (JsonObject command : commands)
+  {
+    bool matched = false;
+    for (device_handle handle = 0; handle < states.size() && !matched; handle++)
+    {
+      matched = isBulkTarget(&states[handle], command);
+    }
+    if (!matched && unknown.size() < BULK_MAX_UNKNOWN)
+    {
+      const char *target = command["device"];
+      unknown.add(target ? target : command["room"] | "");
+    }
+  }
+
+  // Everything a device gets goes out back to back, so it's woken up once
+  DynamicJsonDocument merged(BULK_DEVICE_CAPACITY);
+  std::vector<bulk_target> targets;
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    if (!mergeCommands(&states[handle], commands, merged))
+    {
+      continue;
+    }
+
+    bulk_target target;
+    target.handle = handle;
+    target.grouped = false;
+    target.airtime = 0;
+    readTemperature(&states[handle], &target, merged.as<JsonObject>());
+    targets.push_back(target);
+  }
+
+  const byte groupFrames = planGroups(targets);
+
+  // applySet() changes device records right away, they're put back if the plan is rejected
+  std::vector<state> saved;
+  std::vector<device_handle> savedHandles;
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    savedHandles.push_back(targets[i].handle);
+    saved.push_back(states[targets[i].handle]);
+    for (byte weekDay = 0; weekDay < 7; weekDay++)
+    {
+      retainDaySchedule(saved.back().schedule[weekDay]);
+    }
+  }
+  const bool savedConfigChanged = config_changed;
+
+  std::vector<Message> staged;
+  bulk_staging = &staged;
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    bulk_target *target = &targets[i];
+    state *device = &states[target->handle];
+    mergeCommands(device, commands, merged);
+    JsonObject root = merged.as<JsonObject>();
+    if (target->grouped)
+    {
+      root.remove("temperature");
+      root.remove("desired_temperature");
+      root.remove("mode");
+    }
+
+    target->begin = staged.size();
+    applySet(device, root);
+    target->end = staged.size();
+    yield();
+  }
+  bulk_staging = 0;
+
+  // Only the first frame has to wake the device, the rest follow while it listens. A lost one is retried with the
+  // long preamble by sendMessageFromQueue() like any other.
+  unsigned long airtime = 0;
+  for (size_t i = 0; i < targets.size(); i++)
+  {
+    bulk_target *target = &targets[i];
+    for (uint16_t frame = target->begin; frame < target->end; frame++)
+    {
+      if (frame > target->begin)
+      {
+        staged[frame].longPreamble = false;
+      }
+      target->airtime += frameAirtime(&staged[frame]);
+    }
+    airtime += target->airtime;
+  }
+
+  // Cheap wake-ups first, so quick changes don't wait behind schedule uploads
+  std::stable_sort(targets.begin(), targets.end(), cheaperToWake);
+
+  const size_t queuedAhead = queue.size();
+  const unsigned long ahead = queuedAhead * (BULK_QUEUED_AIRTIME);
+  unsigned long duration = ahead + airtime + (queuedAhead + staged.size()) * BULK_FRAME_GAP;
+  bool rejected = false;
+
+#ifdef CREDIT_15MIN
+  unsigned long windows = 0;
+  if (ahead + airtime > creditMs)
+  {
+    windows = (ahead + airtime - creditMs + (CREDIT_15MIN) - 1) / (CREDIT_15MIN);
+  }
+  duration += windows * 15 * 60 * 1000;
+  rejected = windows > BULK_CREDIT_WINDOWS;
+
+  report["credit_ms"] = creditMs;
+  report["credit_windows"] = windows;
+#endif
+
+  if (rejected)
+  {
+    Debug.printf("Bulk plan %s needs %lu ms of airtime, rejected\n", id, airtime);
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+      state *device = &states[savedHandles[i]];
+      for (byte weekDay = 0; weekDay < 7; weekDay++)
+      {
+        releaseDaySchedule(&device->schedule[weekDay]);
+      }
+      *device = saved[i];
+    }
+    config_changed = savedConfigChanged;
+  }
+  else
+  {
+    for (size_t i = 0; i < saved.size(); i++)
+    {
+      for (byte weekDay = 0; weekDay < 7; weekDay++)
+      {
+        releaseDaySchedule(&saved[i].schedule[weekDay]);
+      }
+    }
+
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+      for (uint16_t frame = targets[i].begin; frame < targets[i].end; frame++)
+      {
+        queue.push(staged[frame]);
+      }
+    }
+  }
+
+  report["status"] = rejected ? "rejected" : "queued";
+  report["devices"] = targets.size();
+  report["group_frames"] = groupFrames;
+  report["frames"] = staged.size();
+  report["queued_ahead"] = queuedAhead;
+  report["airtime_ms"] = airtime;
+  report["duration_s"] = (duration + 999) / 1000;
+
+  publishJson("max/bulk/result", report, false);
+}
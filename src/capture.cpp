@@ -0,0 +1,331 @@
+#include "Arduino.h"
+#include "FS.h"
+#include "capture.hpp"
+#include "replay.hpp"
+#include "time.hpp"
+#include "mqtt.hpp"
+#include "main.hpp"
+
+byte captureSink = CAPTURE_OFF;
+
+byte capture_buffer[CAPTURE_BUFFER_SIZE];
+unsigned int capture_buffer_length = 0;
+unsigned long capture_flushed_at = 0;
+unsigned long capture_clock_at = 0;
+bool capture_clock_written = false;
+unsigned long capture_dropped = 0;
+
+// Ahead of the one in the file header until persisted, UNDEFINED until read from there
+long capture_flash_offset = UNDEFINED;
+byte capture_unpersisted = 0;
+
+// Flash dump in progress, one chunk per loop pass
+long capture_dump_position = UNDEFINED;
+
+const char *CAPTURE_SINKS[] PROGMEM = {
+    "off",
+    "serial",
+    "flash",
+    "mqtt",
+};
+
+byte stringToCaptureSink(const char *sink)
+{
+  if (!sink)
+  {
+    return CAPTURE_OFF;
+  }
+
+  for (byte i = 0; i < 4; i++)
+  {
+    if (strcmp(sink, CAPTURE_SINKS[i]) == 0)
+    {
+      return i;
+    }
+  }
+
+  return CAPTURE_OFF;
+}
+
+const char *captureSinkToString(byte sink)
+{
+  if (sink > CAPTURE_MQTT)
+  {
+    return CAPTURE_SINKS[CAPTURE_OFF];
+  }
+
+  return CAPTURE_SINKS[sink];
+}
+
+// Rewriting the header page on every flush wears the flash, it's only written every CAPTURE_OFFSET_PERSIST flushes
+void writeCaptureOffset(File &file)
+{
+  const uint32_t offset = capture_flash_offset;
+  file.seek(4);
+  file.write((const uint8_t *)&offset, 4);
+  capture_unpersisted = 0;
+}
+
+void persistCaptureOffset()
+{
+  if (capture_unpersisted == 0)
+  {
+    return;
+  }
+
+  File file = SPIFFS.open(CAPTURE_FILE, "r+");
+  if (file)
+  {
+    writeCaptureOffset(file);
+    file.close();
+  }
+}
+
+void setCaptureSink(byte sink)
+{
+  if (sink == captureSink)
+  {
+    return;
+  }
+
+  captureFlush();
+  persistCaptureOffset();
+  captureSink = sink;
+  capture_clock_written = false;
+  Debug.muted = false;
+  Debug.printf("Capturing radio traffic to %s\n", captureSinkToString(sink));
+  // Records only from here on, capture.py can't tell log text from them
+  Debug.muted = sink == CAPTURE_SERIAL;
+}
+
+void writeCaptureToFlash(const byte *data, unsigned int length)
+{
+  File file = SPIFFS.open(CAPTURE_FILE, SPIFFS.exists(CAPTURE_FILE) ? "r+" : "w+");
+  if (!file)
+  {
+    Debug.println("Failed to open capture file");
+    capture_dropped++;
+    return;
+  }
+
+  if (file.size() < CAPTURE_FILE_HEADER_LENGTH)
+  {
+    const uint32_t offset = 0;
+    file.write((const uint8_t *)"MAXC", 4);
+    file.write((const uint8_t *)&offset, 4);
+    capture_flash_offset = 0;
+  }
+  else if (capture_flash_offset == UNDEFINED)
+  {
+    // After a reset the records since the last persisted offset are written over
+    uint32_t offset = 0;
+    file.seek(4);
+    file.read((uint8_t *)&offset, 4);
+    capture_flash_offset = offset % (CAPTURE_FLASH_SIZE);
+  }
+  uint32_t offset = capture_flash_offset;
+
+  // Ring wraps at CAPTURE_FLASH_SIZE, readers start at the stored offset
+  while (length > 0)
+  {
+    unsigned int chunk = min(length, (unsigned int)(CAPTURE_FLASH_SIZE - offset));
+    file.seek(CAPTURE_FILE_HEADER_LENGTH + offset);
+    file.write(data, chunk);
+
+    data += chunk;
+    length -= chunk;
+    offset = (offset + chunk) % (CAPTURE_FLASH_SIZE);
+  }
+
+  capture_flash_offset = offset;
+  if (++capture_unpersisted >= CAPTURE_OFFSET_PERSIST)
+  {
+    writeCaptureOffset(file);
+  }
+  file.close();
+}
+
+void captureFlush()
+{
+  capture_flushed_at = millis();
+
+  if (capture_buffer_length == 0)
+  {
+    return;
+  }
+
+  if (captureSink == CAPTURE_FLASH)
+  {
+    writeCaptureToFlash(capture_buffer, capture_buffer_length);
+  }
+  else if (captureSink == CAPTURE_MQTT)
+  {
+    if (!client.publish("max/capture", capture_buffer, capture_buffer_length))
+    {
+      capture_dropped++;
+    }
+  }
+
+  capture_buffer_length = 0;
+}
+
+void captureClock()
+{
+  capture_clock_at = millis();
+
+  if (!isTimeSynced())
+  {
+    return;
+  }
+
+  uint32_t epoch = nowEpoch();
+  captureFrame(CAPTURE_CLOCK, (const byte *)&epoch, 4, 0, 0);
+  capture_clock_written = true;
+}
+
+void captureFrame(byte flags, const byte *data, byte length, int rssi, byte lqi)
+{
+  if (captureSink == CAPTURE_OFF || replaying)
+  {
+    return;
+  }
+
+  // Every capture starts with a wall clock reference, so readers can map millis to time
+  if (!capture_clock_written && !(flags & CAPTURE_CLOCK))
+  {
+    captureClock();
+  }
+
+  if (length > CAPTURE_MAX_RECORD_LENGTH - CAPTURE_HEADER_LENGTH - 1)
+  {
+    length = CAPTURE_MAX_RECORD_LENGTH - CAPTURE_HEADER_LENGTH - 1;
+  }
+
+  byte record[CAPTURE_MAX_RECORD_LENGTH];
+  uint32_t timestamp = millis();
+  record[0] = CAPTURE_MAGIC;
+  record[1] = flags;
+  memcpy(record + 2, &timestamp, 4);
+  record[6] = (int8_t)rssi;
+  record[7] = lqi;
+  record[8] = length;
+  memcpy(record + CAPTURE_HEADER_LENGTH, data, length);
+
+  const unsigned int recordLength = CAPTURE_HEADER_LENGTH + length + 1;
+  byte checksum = 0;
+  for (unsigned int i = 0; i < recordLength - 1; i++)
+  {
+    checksum += record[i];
+  }
+  record[recordLength - 1] = checksum;
+
+  if (captureSink == CAPTURE_SERIAL)
+  {
+    Serial.write(record, recordLength);
+    return;
+  }
+
+  if (capture_buffer_length + recordLength > CAPTURE_BUFFER_SIZE)
+  {
+    captureFlush();
+  }
+
+  memcpy(capture_buffer + capture_buffer_length, record, recordLength);
+  capture_buffer_length += recordLength;
+}
+
+void captureReceived(CC1101Packet *packet, int rssi, byte result)
+{
+  // CC1101 appends RSSI and LQI/CRC status bytes, they're stored decoded in the record header
+  byte length = packet->length;
+  byte lqi = 0;
+  if (length >= 2)
+  {
+    lqi = packet->data[length - 1];
+    length -= 2;
+  }
+
+  captureFrame(CAPTURE_RX | result, packet->data, length, rssi, lqi);
+}
+
+void captureSent(CC1101Packet *packet, bool longPreamble)
+{
+  captureFrame(CAPTURE_TX | (longPreamble ? CAPTURE_LONG_PREAMBLE : 0), packet->data, packet->length, 0, 0);
+}
+
+void captureLoop()
+{
+  dumpCaptureLoop();
+
+  if (captureSink == CAPTURE_OFF)
+  {
+    return;
+  }
+
+  if (millis() - capture_flushed_at > CAPTURE_FLUSH_INTERVAL)
+  {
+    captureFlush();
+  }
+
+  if (millis() - capture_clock_at > CAPTURE_CLOCK_INTERVAL)
+  {
+    captureClock();
+  }
+}
+
+// Only starts the dump, dumpCaptureLoop() sends it while frames keep being handled
+void dumpCapture()
+{
+  if (captureSink == CAPTURE_FLASH)
+  {
+    captureFlush();
+  }
+  persistCaptureOffset();
+
+  if (!SPIFFS.exists(CAPTURE_FILE))
+  {
+    Debug.println("No capture stored in flash");
+    return;
+  }
+
+  Debug.println("Dumping capture...");
+  capture_dump_position = 0;
+}
+
+void dumpCaptureLoop()
+{
+  if (capture_dump_position == UNDEFINED)
+  {
+    return;
+  }
+
+  File file = SPIFFS.open(CAPTURE_FILE, "r");
+  if (!file)
+  {
+    capture_dump_position = UNDEFINED;
+    return;
+  }
+
+  byte chunk[CAPTURE_BUFFER_SIZE];
+  file.seek(capture_dump_position);
+  const size_t length = file.read(chunk, sizeof(chunk));
+  const size_t size = file.size();
+  file.close();
+
+  if (length == 0)
+  {
+    Debug.println("Capture dump done.");
+    capture_dump_position = UNDEFINED;
+    return;
+  }
+
+  // The rest would be useless to readers with a gap in it
+  if (!isMqttReady() || !client.publish("max/capture/flash", chunk, length))
+  {
+    Debug.printf("Capture dump stopped at %li of %u bytes\n", capture_dump_position, (unsigned)size);
+    capture_dump_position = UNDEFINED;
+    return;
+  }
+
+  capture_dump_position += length;
+}
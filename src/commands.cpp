@@ -0,0 +1,287 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "state.h"
+#include "message.h"
+#include "commands.hpp"
+#include "replay.hpp"
+#include "time.hpp"
+#include "mqtt.hpp"
+#include "main.hpp"
+
+Command commands[COMMAND_SLOTS];
+byte current_command = COMMAND_NONE;
+byte command_counter = 0;
+
+// Upper bounds of latency buckets in ms, last one catches the rest
+const unsigned long LATENCY_BOUNDS[LATENCY_BUCKETS - 1] PROGMEM = {1000, 2000, 5000, 10000, 30000, 60000, 120000};
+const char *COMMAND_TYPE_NAMES[] PROGMEM = {
+    "temperature",
+    "config",
+    "schedule",
+    "associate",
+    "other",
+};
+
+unsigned int command_latency[COMMAND_TYPES][LATENCY_BUCKETS];
+bool command_latency_changed = false;
+unsigned long command_latency_published_at = 0;
+
+byte commandType(JsonObject root)
+{
+  if (root.containsKey("temperature") || root.containsKey("desired_temperature") || root.containsKey("mode"))
+  {
+    return COMMAND_TEMPERATURE;
+  }
+  if (root.containsKey("schedule"))
+  {
+    return COMMAND_SCHEDULE;
+  }
+  if (root.containsKey("associate"))
+  {
+    return COMMAND_ASSOCIATE;
+  }
+  if (root.size() > 0)
+  {
+    return COMMAND_CONFIG;
+  }
+  return COMMAND_OTHER;
+}
+
+void publishCommandStatus(Command *command, const char *status, byte attempt = 0)
+{
+  if (replaying)
+  {
+    return;
+  }
+
+  state *device = findDeviceByAddress(command->address);
+  if (!device)
+  {
+    return;
+  }
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(6)> doc;
+  doc["id"] = command->id;
+  doc["status"] = status;
+  doc["uptime_ms"] = millis();
+  if (isTimeSynced())
+  {
+    doc["time"] = formatTime("%Y-%m-%d %H:%M:%S");
+  }
+  if (attempt)
+  {
+    doc["attempt"] = attempt;
+  }
+  if (!strcmp(status, "acked") || !strcmp(status, "sent") || !strcmp(status, "failed") || !strcmp(status, "evicted"))
+  {
+    doc["latency_ms"] = millis() - command->received_at;
+  }
+  char topic[MQTT_TOPIC_MAX];
+  publishJson(deviceTopic(topic, device, "/result"), doc, false);
+}
+
+void beginCommand(state *device, JsonObject root)
+{
+  byte slot = 0;
+  for (byte i = 0; i < COMMAND_SLOTS; i++)
+  {
+    if (!commands[i].used)
+    {
+      slot = i;
+      break;
+    }
+
+    // Evict oldest when all are waiting
+    if (commands[i].received_at - commands[slot].received_at > 0x7FFFFFFFUL)
+    {
+      slot = i;
+    }
+  }
+
+  Command *command = &commands[slot];
+  if (command->used)
+  {
+    // Its frames may still go out, but nothing will be reported for them
+    Debug.printf("Command %s evicted before it finished\n", command->id);
+    publishCommandStatus(command, "evicted");
+  }
+  command->used = true;
+  command->generation++;
+  strlcpy(command->id, root["id"] | "", COMMAND_ID_LENGTH);
+  if (command->id[0] == '\0')
+  {
+    snprintf(command->id, COMMAND_ID_LENGTH, "%lx%02x", millis(), command_counter++);
+  }
+  memcpy(command->address, device->address, 3);
+  command->type = commandType(root);
+  command->pending = 0;
+  command->acked = 0;
+  command->transmitted = false;
+  command->failed = false;
+  command->received_at = millis();
+
+  current_command = slot;
+}
+
+void recordLatency(Command *command)
+{
+  const unsigned long latency = millis() - command->received_at;
+  byte bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && latency >= LATENCY_BOUNDS[bucket])
+  {
+    bucket++;
+  }
+
+  command_latency[command->type][bucket]++;
+  command_latency_changed = true;
+}
+
+// Only commands a device ACKed count towards the latency histograms
+void finishCommand(Command *command)
+{
+  if (command->failed)
+  {
+    publishCommandStatus(command, "failed");
+  }
+  else if (command->acked > 0)
+  {
+    publishCommandStatus(command, "acked");
+    recordLatency(command);
+  }
+  else
+  {
+    publishCommandStatus(command, "sent");
+  }
+  command->used = false;
+}
+
+void endCommand()
+{
+  if (current_command == COMMAND_NONE)
+  {
+    return;
+  }
+
+  Command *command = &commands[current_command];
+  current_command = COMMAND_NONE;
+
+  if (command->pending == 0)
+  {
+    // Nothing to send, e.g. room change or config the device already has
+    publishCommandStatus(command, command->failed ? "failed" : "done");
+    command->used = false;
+  }
+  else
+  {
+    publishCommandStatus(command, "queued");
+  }
+}
+
+// Part of the command was refused before anything got queued for it
+void failCommand()
+{
+  if (current_command != COMMAND_NONE)
+  {
+    commands[current_command].failed = true;
+  }
+}
+
+void tagCommand(Message *message)
+{
+  message->command = current_command;
+  if (current_command != COMMAND_NONE)
+  {
+    message->commandGeneration = commands[current_command].generation;
+    commands[current_command].pending++;
+  }
+}
+
+Command *commandOf(Message *message)
+{
+  if (message->command == COMMAND_NONE)
+  {
+    return 0;
+  }
+
+  Command *command = &commands[message->command];
+  if (!command->used || command->generation != message->commandGeneration)
+  {
+    return 0;
+  }
+
+  return command;
+}
+
+void commandTransmitted(Message *message)
+{
+  Command *command = commandOf(message);
+  if (!command)
+  {
+    return;
+  }
+
+  if (message->retryCounter > 0)
+  {
+    publishCommandStatus(command, "retried", message->retryCounter + 1);
+  }
+  else if (!command->transmitted)
+  {
+    command->transmitted = true;
+    publishCommandStatus(command, "transmitted");
+  }
+}
+
+void commandFrameDone(Message *message, byte outcome)
+{
+  Command *command = commandOf(message);
+  if (!command)
+  {
+    return;
+  }
+
+  if (outcome == FRAME_ACKED)
+  {
+    command->acked++;
+  }
+  else if (outcome == FRAME_FAILED)
+  {
+    command->failed = true;
+  }
+
+  if (command->pending > 0 && --command->pending == 0)
+  {
+    finishCommand(command);
+  }
+}
+
+void publishCommandLatency()
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(COMMAND_TYPES + 1) + (COMMAND_TYPES + 1) * JSON_ARRAY_SIZE(LATENCY_BUCKETS)> doc;
+
+  JsonArray bounds = doc.createNestedArray("bounds_ms");
+  for (byte bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+  {
+    bounds.add(LATENCY_BOUNDS[bucket]);
+  }
+
+  for (byte type = 0; type < COMMAND_TYPES; type++)
+  {
+    JsonArray histogram = doc.createNestedArray(COMMAND_TYPE_NAMES[type]);
+    for (byte bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+      histogram.add(command_latency[type][bucket]);
+    }
+  }
+
+  publishTelemetry("max/commands/latency", doc, true);
+}
+
+void commandsLoop()
+{
+  if (command_latency_changed && millis() - command_latency_published_at > LATENCY_INTERVAL)
+  {
+    command_latency_changed = false;
+    command_latency_published_at = millis();
+    publishCommandLatency();
+  }
+}
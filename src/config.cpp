@@ -4,8 +4,15 @@
 #include "state.h"
 #include "max.h"
 #include "main.hpp"
+#include "capture.hpp"
+#include "device_index.hpp"
+#include "rooms.hpp"
+#include "stale_wheel.hpp"
+#include "snapshot.hpp"
+#include "mqtt.hpp"
+#include "raw.hpp"
 
-const size_t CONFIG_CAPACITY PROGMEM = JSON_OBJECT_SIZE(10) + 1024;
+const size_t CONFIG_CAPACITY PROGMEM = JSON_OBJECT_SIZE(16) + 1024;
 
 void format()
 {
@@ -40,8 +47,12 @@ void parseDeviceConfigFile(state *device, String filename)
 
   const char *address = root["address"];
   stringToBytes(device->address, address, 6);
-  device->name = root["name"] | "";
-  device->room = root["room"] | "";
+  nameDevice(device, root["name"] | "");
+  if (!isRoutableName(root["name"] | ""))
+  {
+    Debug.printf("%s has more than %i levels, commands to it won't arrive\n", (const char *)(root["name"] | ""), DEVICE_TOPIC_LEVELS);
+  }
+  device->room = internString(root["room"] | "");
   device->type = root["type"] | UNDEFINED;
   device->group = root["group"] | 0;
 
@@ -52,11 +63,11 @@ void parseDeviceConfigFile(state *device, String filename)
       device->display_actual_temperature = root["display_actual_temperature"];
     }
 
-    device->eco_temperature = root["eco"] | 17;
-    device->comfort_temperature = root["comfort"] | 21;
-    device->max_temperature = root["max"] | 30.5;
-    device->min_temperature = root["min"] | 4.5;
-    device->window_open_temperature = root["window_open"] | 4.5;
+    device->eco_temperature = TENTHS_TO_HALVES(jsonToTemperature(root["eco"], 170));
+    device->comfort_temperature = TENTHS_TO_HALVES(jsonToTemperature(root["comfort"], 210));
+    device->max_temperature = TENTHS_TO_HALVES(jsonToTemperature(root["max"], 305));
+    device->min_temperature = TENTHS_TO_HALVES(jsonToTemperature(root["min"], 45));
+    device->window_open_temperature = TENTHS_TO_HALVES(jsonToTemperature(root["window_open"], 45));
 
     device->decalc_weekday = root["decalc_weekday"] | 0;
     device->decalc_hour = root["decalc_hour"] | 12;
@@ -65,15 +76,36 @@ void parseDeviceConfigFile(state *device, String filename)
     device->max_valve_setting = root["max_valve_setting"] | 100;
     device->valve_offset = root["valve_offset"] | 0;
 
-    byte association_address[3];
     if (root.containsKey("associations"))
     {
       JsonArray associations = root["associations"].as<JsonArray>();
       for (JsonVariant v : associations)
       {
+        if (device->associations == ASSOCIATIONS_MAX)
+        {
+          device->associations_unstored++;
+          continue;
+        }
         const char *value = v.as<const char *>();
-        stringToBytes(association_address, value, 6);
-        device->associated_devices.insert(device->associated_devices.end(), association_address, association_address + 3);
+        stringToBytes(device->associated_devices[device->associations++], value, 6);
+      }
+
+      if (device->associations_unstored)
+      {
+        Debug.printf("%i associations of %s beyond %i stay in flash only\n", device->associations_unstored, pooledString(device->name), ASSOCIATIONS_MAX);
+      }
+    }
+
+    if (root.containsKey("fingerprints"))
+    {
+      JsonArray fingerprints = root["fingerprints"].as<JsonArray>();
+      byte block = 0;
+      for (JsonVariant v : fingerprints)
+      {
+        if (block < CONFIG_BLOCKS)
+        {
+          device->config_fingerprint[block++] = v.as<uint32_t>();
+        }
       }
     }
 
@@ -81,20 +113,23 @@ void parseDeviceConfigFile(state *device, String filename)
     {
       JsonArray schedule = root["schedule"].as<JsonArray>();
       byte weekDay = 0;
+      byte day_schedule[DAY_SCHEDULE_LENGTH];
       for (JsonVariant v : schedule)
       {
-        if (device->schedule[weekDay] != 0)
+        if (weekDay == 7)
         {
-          delete[] device->schedule[weekDay];
+          break;
         }
 
         if (!v.isNull())
         {
           const char *value = v.as<const char *>();
-          byte schedule_size = strlen(value);
-          device->schedule_size[weekDay] = schedule_size / 2;
-          device->schedule[weekDay] = new byte[schedule_size / 2];
-          stringToBytes(device->schedule[weekDay], value, schedule_size);
+          const unsigned int length = min(strlen(value), (size_t)DAY_SCHEDULE_LENGTH * 2);
+          if (!storeDaySchedule(&device->schedule[weekDay], day_schedule, stringToBytes(day_schedule, value, length)))
+          {
+            Debug.printf("Schedule arena is full, day %i of %s stays in flash only\n", weekDay, pooledString(device->name));
+            device->schedule_unstored |= 1 << weekDay;
+          }
         }
 
         weekDay++;
@@ -102,7 +137,7 @@ void parseDeviceConfigFile(state *device, String filename)
     }
   }
 
-  Debug.printf("Loaded name: %s, type: %i\n", device->name.c_str(), device->type);
+  Debug.printf("Loaded name: %s, type: %i\n", pooledString(device->name), device->type);
   config.clear();
 }
 
@@ -134,27 +169,88 @@ bool loadConfig()
   const char *myAddressConfig = config["address"] | "123456";
   stringToBytes(myAddress, myAddressConfig, 6);
   autocreate = config["autocreate"] | true;
-
-  int i = 0;
+  setCaptureSink(stringToCaptureSink(config["capture"] | "off"));
+  publish_deadband_temperature = jsonToTemperature(config["deadband_temperature"], PUBLISH_DEADBAND_TEMPERATURE);
+  publish_deadband_valve = config["deadband_valve"] | PUBLISH_DEADBAND_VALVE;
+  publish_heartbeat = config["heartbeat"] | PUBLISH_HEARTBEAT;
+  snapshot_enabled = config["snapshot"] | false;
+  telemetry_format = stringToPayloadFormat(config["format"]);
+  raw_enabled = config["raw"] | false;
+  raw_batch_frames = config["raw_frames"] | RAW_BATCH_FRAMES;
+  raw_batch_interval = config["raw_interval"] | RAW_BATCH_INTERVAL;
+
+  // Size the device slabs once for the known devices, autocreate grows them by a slab at a time
+  size_t devices = 0;
   Dir dir = SPIFFS.openDir("/devices");
-  state *device;
+  while (dir.next())
+  {
+    devices++;
+  }
+  states.reserve(devices);
+  setupScheduleArena(devices);
+
+  dir = SPIFFS.openDir("/devices");
   while (dir.next())
   {
     String path = dir.fileName();
-    Serial.printf("Parsing config at: %s\n", path.c_str());
+    Debug.printf("Parsing config at: %s\n", path.c_str());
 
-    states.push_back(state());
-    device = &states.back();
-    parseDeviceConfigFile(device, path);
+    parseDeviceConfigFile(&states[states.add()], path);
   }
+  rebuildDeviceIndex();
+  rebuildRooms();
+  rebuildStaleWheel();
 
   return true;
 }
 
-char schedule_buffer[DAY_SCHEDULE_LENGTH];
+char schedule_buffer[DAY_SCHEDULE_LENGTH * 2 + 1];
+char unstored_days[7][DAY_SCHEDULE_LENGTH * 2 + 1];
+char unstored_associations[ASSOCIATIONS_MAX][7];
+byte unstored_associations_count = 0;
+
+// Days that didn't fit into the arena and associations beyond ASSOCIATIONS_MAX are copied from the file being
+// replaced, so saving doesn't erase them
+void readUnstored(state *device, const String &path)
+{
+  unstored_associations_count = 0;
+
+  DynamicJsonDocument old(CONFIG_CAPACITY);
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+  {
+    return;
+  }
+
+  DeserializationError error = deserializeJson(old, file);
+  file.close();
+  if (error)
+  {
+    return;
+  }
+
+  JsonArray schedule = old["schedule"].as<JsonArray>();
+  for (byte weekDay = 0; weekDay < 7; weekDay++)
+  {
+    strlcpy(unstored_days[weekDay], schedule[weekDay] | "", sizeof(unstored_days[weekDay]));
+  }
+
+  JsonArray associations = old["associations"].as<JsonArray>();
+  for (size_t i = ASSOCIATIONS_MAX; i < associations.size() && unstored_associations_count < ASSOCIATIONS_MAX; i++)
+  {
+    strlcpy(unstored_associations[unstored_associations_count++], associations[i] | "", sizeof(unstored_associations[0]));
+  }
+  if (associations.size() > ASSOCIATIONS_MAX * 2)
+  {
+    Debug.printf("Dropping %i associations of %s beyond %i\n", (int)associations.size() - ASSOCIATIONS_MAX * 2, pooledString(device->name), ASSOCIATIONS_MAX * 2);
+  }
+}
 
 bool saveConfig()
 {
+  // Drop names and rooms left behind by renames
+  collectStrings();
+
   File configFile = SPIFFS.open("/config.json", "w");
   if (!configFile)
   {
@@ -167,6 +263,15 @@ bool saveConfig()
   bytesToString(address, myAddress, 3);
   config["address"] = address;
   config["autocreate"] = autocreate;
+  config["capture"] = captureSinkToString(captureSink);
+  config["deadband_temperature"] = TENTHS_TO_JSON(publish_deadband_temperature);
+  config["deadband_valve"] = publish_deadband_valve;
+  config["heartbeat"] = publish_heartbeat;
+  config["snapshot"] = snapshot_enabled;
+  config["format"] = payloadFormatToString(telemetry_format);
+  config["raw"] = raw_enabled;
+  config["raw_frames"] = raw_batch_frames;
+  config["raw_interval"] = raw_batch_interval;
 
   Debug.println("Saving main config file...");
   if (serializeJson(config, configFile) == 0)
@@ -196,20 +301,33 @@ bool saveConfig()
     path += address;
     path += ".json";
 
+    if (device->schedule_unstored || device->associations_unstored)
+    {
+      readUnstored(device, path);
+    }
+
     File configFile = SPIFFS.open(path, "w");
 
-    config["name"] = device->name;
-    config["room"] = device->room;
+    config["name"] = pooledString(device->name);
+    config["room"] = pooledString(device->room);
     config["address"] = address;
     config["type"] = device->type;
     config["group"] = device->group;
 
     JsonArray associations = config.createNestedArray("associations");
-    for (byte pos = 0; pos < device->associated_devices.size(); pos += 3)
+    for (byte i = 0; i < device->associations; i++)
     {
-      bytesToString(address, device->associated_devices.data() + pos, 3);
+      bytesToString(address, device->associated_devices[i], 3);
       associations.add(address);
     }
+    if (device->associations_unstored)
+    {
+      for (byte i = 0; i < unstored_associations_count; i++)
+      {
+        associations.add(unstored_associations[i]);
+      }
+      device->associations_unstored = unstored_associations_count;
+    }
 
     if (device->type == DEVICE_WALL_THERMOSTAT || device->type == DEVICE_HEATING_THERMOSTAT)
     {
@@ -218,11 +336,11 @@ bool saveConfig()
         config["display_actual_temperature"] = (bool)device->display_actual_temperature;
       }
 
-      config["eco"] = device->eco_temperature;
-      config["comfort"] = device->comfort_temperature;
-      config["max"] = device->max_temperature;
-      config["min"] = device->min_temperature;
-      config["window_open"] = device->window_open_temperature;
+      config["eco"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->eco_temperature));
+      config["comfort"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->comfort_temperature));
+      config["max"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->max_temperature));
+      config["min"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->min_temperature));
+      config["window_open"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->window_open_temperature));
 
       config["decalc_weekday"] = device->decalc_weekday;
       config["decalc_hour"] = device->decalc_hour;
@@ -231,12 +349,22 @@ bool saveConfig()
       config["max_valve_setting"] = device->max_valve_setting;
       config["valve_offset"] = device->valve_offset;
 
+      JsonArray fingerprints = config.createNestedArray("fingerprints");
+      for (byte block = 0; block < CONFIG_BLOCKS; block++)
+      {
+        fingerprints.add(device->config_fingerprint[block]);
+      }
+
       JsonArray schedule = config.createNestedArray("schedule");
       for (byte weekDay = 0; weekDay < 7; weekDay++)
       {
-        if (device->schedule_size[weekDay] > 0)
+        if ((device->schedule_unstored & (1 << weekDay)) && unstored_days[weekDay][0])
+        {
+          schedule.add(unstored_days[weekDay]);
+        }
+        else if (device->schedule[weekDay] != SCHEDULE_NONE)
         {
-          bytesToString(schedule_buffer, device->schedule[weekDay], device->schedule_size[weekDay]);
+          bytesToString(schedule_buffer, (byte *)daySchedule(device->schedule[weekDay]), dayScheduleSize(device->schedule[weekDay]));
           schedule.add(schedule_buffer);
         }
         else
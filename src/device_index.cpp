@@ -0,0 +1,160 @@
+#include "Arduino.h"
+#include <vector>
+#include "state.h"
+#include "fingerprint.hpp"
+#include "device_index.hpp"
+#include "main.hpp"
+
+// Open addressing with linear probing, keyed by 24-bit address, values are positions in states.
+// Kept at most half full, so probes stay short.
+std::vector<uint16_t> device_index(DEVICE_INDEX_MIN_CAPACITY, DEVICE_INDEX_EMPTY);
+uint16_t device_index_count = 0;
+
+// Same scheme keyed by name, for routing max/<name>/set
+std::vector<uint16_t> device_name_index(DEVICE_INDEX_MIN_CAPACITY, DEVICE_INDEX_EMPTY);
+uint16_t device_name_index_count = 0;
+
+uint32_t addressKey(const byte *address)
+{
+  return ((uint32_t)address[0] << 16) | ((uint32_t)address[1] << 8) | address[2];
+}
+
+uint16_t addressSlot(uint32_t key)
+{
+  // Fibonacci hashing, capacity is a power of two
+  return ((uint32_t)(key * 2654435769UL) >> 16) & (device_index.size() - 1);
+}
+
+void insertIntoIndex(uint16_t position)
+{
+  const uint32_t key = addressKey(states[position].address);
+  uint16_t slot = addressSlot(key);
+
+  while (device_index[slot] != DEVICE_INDEX_EMPTY)
+  {
+    if (addressKey(states[device_index[slot]].address) == key)
+    {
+      device_index[slot] = position;
+      return;
+    }
+    slot = (slot + 1) & (device_index.size() - 1);
+  }
+
+  device_index[slot] = position;
+  device_index_count++;
+}
+
+uint16_t nameSlot(const char *name, size_t length)
+{
+  return fingerprint((const byte *)name, length) & (device_name_index.size() - 1);
+}
+
+bool nameEquals(state *device, const char *name, size_t length)
+{
+  const char *deviceName = pooledString(device->name);
+  return strlen(deviceName) == length && memcmp(deviceName, name, length) == 0;
+}
+
+void insertIntoNameIndex(uint16_t position)
+{
+  state *device = &states[position];
+  if (device->name == STRING_NONE)
+  {
+    return;
+  }
+
+  const char *name = pooledString(device->name);
+  uint16_t slot = nameSlot(name, strlen(name));
+  while (device_name_index[slot] != DEVICE_INDEX_EMPTY)
+  {
+    if (device_name_index[slot] == position)
+    {
+      return;
+    }
+    slot = (slot + 1) & (device_name_index.size() - 1);
+  }
+
+  device_name_index[slot] = position;
+  device_name_index_count++;
+}
+
+void rebuildDeviceIndex()
+{
+  size_t capacity = DEVICE_INDEX_MIN_CAPACITY;
+  while (capacity < states.size() * 2)
+  {
+    capacity *= 2;
+  }
+
+  device_index.assign(capacity, DEVICE_INDEX_EMPTY);
+  device_index_count = 0;
+  device_name_index.assign(capacity, DEVICE_INDEX_EMPTY);
+  device_name_index_count = 0;
+
+  for (uint16_t position = 0; position < states.size(); position++)
+  {
+    insertIntoIndex(position);
+    insertIntoNameIndex(position);
+  }
+}
+
+void indexDevice(uint16_t position)
+{
+  if ((device_index_count + 1) * 2 > device_index.size())
+  {
+    rebuildDeviceIndex();
+    return;
+  }
+
+  insertIntoIndex(position);
+}
+
+void indexDeviceName(uint16_t position)
+{
+  if ((device_name_index_count + 1) * 2 > device_name_index.size())
+  {
+    rebuildDeviceIndex();
+    return;
+  }
+
+  insertIntoNameIndex(position);
+}
+
+int findDevicePositionByAddress(const byte *address)
+{
+  const uint32_t key = addressKey(address);
+  uint16_t slot = addressSlot(key);
+
+  while (device_index[slot] != DEVICE_INDEX_EMPTY)
+  {
+    const uint16_t position = device_index[slot];
+    if (position < states.size() && addressKey(states[position].address) == key)
+    {
+      return position;
+    }
+    slot = (slot + 1) & (device_index.size() - 1);
+  }
+
+  return -1;
+}
+
+int findDevicePositionByName(const char *name, size_t length)
+{
+  if (length == 0)
+  {
+    return -1;
+  }
+
+  uint16_t slot = nameSlot(name, length);
+  while (device_name_index[slot] != DEVICE_INDEX_EMPTY)
+  {
+    const uint16_t position = device_name_index[slot];
+    if (position < states.size() && nameEquals(&states[position], name, length))
+    {
+      return position;
+    }
+    slot = (slot + 1) & (device_name_index.size() - 1);
+  }
+
+  return -1;
+}
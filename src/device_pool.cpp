@@ -0,0 +1,72 @@
+#include "Arduino.h"
+#include <vector>
+#include <algorithm>
+#include "state.h"
+#include "device_pool.hpp"
+
+DevicePool states;
+
+void DevicePool::reserve(size_t records)
+{
+  chunks.reserve((records + DEVICE_CHUNK - 1) / DEVICE_CHUNK);
+  while (capacity() < records)
+  {
+    chunks.push_back(new state[DEVICE_CHUNK]);
+  }
+}
+
+device_handle DevicePool::add()
+{
+  reserve(count + 1);
+
+  const device_handle handle = count++;
+  (*this)[handle] = state();
+  return handle;
+}
+
+int DevicePool::handleOf(const state *device)
+{
+  for (uint16_t i = 0; i < chunks.size(); i++)
+  {
+    if (device >= chunks[i] && device < chunks[i] + DEVICE_CHUNK)
+    {
+      return i * DEVICE_CHUNK + (device - chunks[i]);
+    }
+  }
+
+  return -1;
+}
+
+void DevicePool::save(std::vector<state> &saved)
+{
+  saved.clear();
+  saved.reserve(count);
+  for (device_handle handle = 0; handle < count; handle++)
+  {
+    saved.push_back((*this)[handle]);
+  }
+}
+
+// Swaps the records with other, slabs are kept for reuse when other has fewer
+void DevicePool::exchange(std::vector<state> &other)
+{
+  const device_handle theirs = other.size();
+  const device_handle ours = count;
+  reserve(theirs);
+
+  for (device_handle handle = 0; handle < min(ours, theirs); handle++)
+  {
+    std::swap((*this)[handle], other[handle]);
+  }
+  for (device_handle handle = ours; handle < theirs; handle++)
+  {
+    (*this)[handle] = other[handle];
+  }
+  other.resize(ours);
+  for (device_handle handle = theirs; handle < ours; handle++)
+  {
+    other[handle] = (*this)[handle];
+  }
+
+  count = theirs;
+}
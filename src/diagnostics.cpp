@@ -0,0 +1,62 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "state.h"
+#include "string_pool.hpp"
+#include "schedule_arena.hpp"
+#include "history.hpp"
+#include "diagnostics.hpp"
+#include "mqtt.hpp"
+#include "outbox.hpp"
+#include "network.hpp"
+#include "raw.hpp"
+#include "main.hpp"
+
+unsigned long diagnostics_published_at = 0;
+
+// Memory use per device, retained on max/diagnostics
+void publishDiagnostics()
+{
+  diagnostics_published_at = millis();
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(29)> doc;
+  doc["free_heap"] = ESP.getFreeHeap();
+  doc["max_free_block"] = ESP.getMaxFreeBlockSize();
+  doc["heap_fragmentation"] = ESP.getHeapFragmentation();
+  doc["devices"] = states.size();
+  doc["device_bytes"] = sizeof(state);
+  doc["states_bytes"] = states.capacity() * sizeof(state);
+  doc["schedule_slots"] = scheduleSlotsUsed();
+  doc["schedule_capacity"] = scheduleCapacity();
+  doc["schedule_bytes"] = scheduleCapacity() * sizeof(schedule_slot);
+  doc["strings"] = stringPoolCount();
+  doc["string_bytes"] = stringPoolBytes();
+  doc["history_bytes"] = historyBytes();
+  doc["queue"] = queue.size();
+  doc["queue_bytes"] = queue.size() * sizeof(Message);
+  doc["rx_dropped"] = rx_dropped;
+  doc["outbox"] = outboxCount();
+  doc["outbox_bytes"] = outboxBytes();
+  doc["outbox_size"] = outboxSize();
+  doc["outbox_buffered"] = outbox_buffered;
+  doc["outbox_coalesced"] = outbox_coalesced;
+  doc["outbox_dropped"] = outbox_dropped;
+  doc["wifi_disconnects"] = wifi_disconnects;
+  doc["wifi_disconnected_s"] = wifiDisconnectedSeconds();
+  doc["network_ms"] = network_us / 1000;
+  doc["network_max_us"] = network_max_us;
+  doc["publishes"] = publishCount();
+  doc["publish_us"] = publishCount() ? publishMicros() / publishCount() : 0;
+  doc["raw_frames"] = raw_frames;
+  doc["raw_dropped"] = raw_dropped;
+
+  publishTelemetry("max/diagnostics", doc, true);
+  network_max_us = 0;
+}
+
+void diagnosticsLoop()
+{
+  if (millis() - diagnostics_published_at > DIAGNOSTICS_INTERVAL)
+  {
+    publishDiagnostics();
+  }
+}
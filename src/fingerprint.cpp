@@ -0,0 +1,127 @@
+#include "Arduino.h"
+#include <queue>
+#include "state.h"
+#include "message.h"
+#include "fingerprint.hpp"
+#include "main.hpp"
+
+// Block and owner of frames being queued, see beginConfigBlock()
+byte queueing_config_block = CONFIG_BLOCK_NONE;
+byte queueing_config_owner[3];
+
+// FNV-1a folded to 16 bits, for hash table slots
+uint16_t fingerprint(const byte *data, unsigned int length)
+{
+  uint32_t hash = 2166136261UL;
+  for (unsigned int i = 0; i < length; i++)
+  {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+
+  uint16_t folded = (hash >> 16) ^ (hash & 0xFFFF);
+  return folded ? folded : 1;
+}
+
+// Full 32-bit FNV-1a for config blocks, a collision would keep a real change from being sent. 0 is reserved for unknown.
+uint32_t configFingerprint(const byte *data, unsigned int length)
+{
+  uint32_t hash = 2166136261UL;
+  for (unsigned int i = 0; i < length; i++)
+  {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+
+  return hash ? hash : 1;
+}
+
+bool isConfigBlockCurrent(state *device, byte block, uint32_t fingerprint)
+{
+  if (device->config_fingerprint[block] == fingerprint)
+  {
+    Debug.printf("Config block %i of %s is unchanged, not sending\n", block, pooledString(device->name));
+    return true;
+  }
+
+  return false;
+}
+
+// Frames queued until endConfigBlock() carry one config block, it's current once all of them got ACKed
+void beginConfigBlock(state *device, byte block)
+{
+  queueing_config_block = block;
+  memcpy(queueing_config_owner, device->address, 3);
+  device->config_failed &= ~(1 << block);
+}
+
+void endConfigBlock(uint32_t fingerprint)
+{
+  Message *last = lastQueuedMessage();
+  if (last && last->configBlock == queueing_config_block)
+  {
+    last->fingerprint = fingerprint;
+    last->completesBlock = true;
+  }
+
+  queueing_config_block = CONFIG_BLOCK_NONE;
+}
+
+void tagConfigBlock(Message *message)
+{
+  message->configBlock = queueing_config_block;
+  memcpy(message->configOwner, queueing_config_owner, 3);
+  message->fingerprint = 0;
+  message->completesBlock = false;
+}
+
+void configBlockAcked(Message *message)
+{
+  if (message->configBlock == CONFIG_BLOCK_NONE || !message->completesBlock)
+  {
+    return;
+  }
+
+  state *device = findDeviceByAddress(message->configOwner);
+  if (!device)
+  {
+    return;
+  }
+
+  const uint16_t mask = 1 << message->configBlock;
+  if (device->config_failed & mask)
+  {
+    // Part of the block got lost, send it whole next time
+    device->config_failed &= ~mask;
+    device->config_fingerprint[message->configBlock] = 0;
+  }
+  else
+  {
+    device->config_fingerprint[message->configBlock] = message->fingerprint;
+  }
+  config_changed = true;
+}
+
+void configBlockFailed(Message *message)
+{
+  if (message->configBlock == CONFIG_BLOCK_NONE)
+  {
+    return;
+  }
+
+  state *device = findDeviceByAddress(message->configOwner);
+  if (device)
+  {
+    device->config_failed |= 1 << message->configBlock;
+    device->config_fingerprint[message->configBlock] = 0;
+  }
+}
+
+void forgetConfigBlocks(state *device)
+{
+  for (byte block = 0; block < CONFIG_BLOCKS; block++)
+  {
+    device->config_fingerprint[block] = 0;
+  }
+  config_changed = true;
+}
@@ -0,0 +1,309 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <vector>
+#include "max.h"
+#include "state.h"
+#include "time.hpp"
+#include "device_pool.hpp"
+#include "replay.hpp"
+#include "history.hpp"
+#include "mqtt.hpp"
+#include "main.hpp"
+
+// By device handle, allocated on a thermostat's first sample
+std::vector<history_ring *> histories;
+
+byte encodeKey(byte *record, const history_sample *sample)
+{
+  record[0] = HISTORY_KEY;
+  memcpy(record + 1, &sample->tick, 2);
+  memcpy(record + 3, &sample->measured, 2);
+  record[5] = sample->desired;
+  record[6] = sample->valve;
+  record[7] = sample->rssi;
+  return HISTORY_KEY_LENGTH;
+}
+
+// 0 when the change doesn't fit a delta
+byte encodeDelta(byte *record, const history_sample *last, const history_sample *sample)
+{
+  const tick_t ticks = sample->tick - last->tick;
+  const int deltas[4] = {
+      sample->measured - last->measured,
+      sample->desired - last->desired,
+      sample->valve - last->valve,
+      sample->rssi - last->rssi,
+  };
+
+  if (ticks > 0xFF)
+  {
+    return 0;
+  }
+
+  byte length = 2;
+  record[0] = 0;
+  record[1] = ticks;
+  for (byte field = 0; field < 4; field++)
+  {
+    if (deltas[field] == 0)
+    {
+      continue;
+    }
+    if (deltas[field] < -128 || deltas[field] > 127)
+    {
+      return 0;
+    }
+
+    record[0] |= 1 << field;
+    record[length++] = (int8_t)deltas[field];
+  }
+
+  return length;
+}
+
+void recordHistory(device_handle handle, int rssi)
+{
+  state *device = &states[handle];
+  if (replaying || (device->type != DEVICE_HEATING_THERMOSTAT && device->type != DEVICE_WALL_THERMOSTAT))
+  {
+    return;
+  }
+
+  if (histories.size() <= handle)
+  {
+    histories.resize(handle + 1, 0);
+  }
+  if (!histories[handle])
+  {
+    histories[handle] = new history_ring();
+  }
+  history_ring *ring = histories[handle];
+
+  history_sample sample;
+  sample.tick = nowTicks();
+  sample.measured = device->measured_temperature;
+  sample.desired = device->desired_temperature;
+  sample.valve = device->valve_position;
+  sample.rssi = constrain(rssi, -128, 127);
+
+  // Newest block is only empty before the first sample
+  const bool empty = ring->used[ring->newest] == 0;
+  if (!empty)
+  {
+    // RSSI jitters by a dB or two from frame to frame
+    if (abs(sample.rssi - ring->last.rssi) < HISTORY_RSSI_DEADBAND)
+    {
+      sample.rssi = ring->last.rssi;
+    }
+
+    if (sample.measured == ring->last.measured && sample.desired == ring->last.desired && sample.valve == ring->last.valve && sample.rssi == ring->last.rssi)
+    {
+      return;
+    }
+  }
+
+  byte record[HISTORY_KEY_LENGTH];
+  byte length = empty ? 0 : encodeDelta(record, &ring->last, &sample);
+  if (ring->used[ring->newest] + length > HISTORY_BLOCK_SIZE)
+  {
+    length = 0;
+  }
+
+  if (length == 0)
+  {
+    // Also starts the next block, so dropping the oldest leaves the rest decodable
+    length = encodeKey(record, &sample);
+    if (ring->used[ring->newest] + length > HISTORY_BLOCK_SIZE)
+    {
+      ring->newest = (ring->newest + 1) % HISTORY_BLOCKS;
+      ring->used[ring->newest] = 0;
+    }
+  }
+
+  memcpy(ring->blocks[ring->newest] + ring->used[ring->newest], record, length);
+  ring->used[ring->newest] += length;
+  ring->last = sample;
+}
+
+// Oldest first
+byte decodeHistory(history_ring *ring, history_sample *samples)
+{
+  byte count = 0;
+  for (byte i = 1; i <= HISTORY_BLOCKS; i++)
+  {
+    const byte block = (ring->newest + i) % HISTORY_BLOCKS;
+    const byte *data = ring->blocks[block];
+    byte position = 0;
+    history_sample sample = {};
+
+    while (position < ring->used[block] && count < HISTORY_SAMPLES_MAX)
+    {
+      const byte flags = data[position];
+      if (flags & HISTORY_KEY)
+      {
+        memcpy(&sample.tick, data + position + 1, 2);
+        memcpy(&sample.measured, data + position + 3, 2);
+        sample.desired = data[position + 5];
+        sample.valve = data[position + 6];
+        sample.rssi = data[position + 7];
+        position += HISTORY_KEY_LENGTH;
+      }
+      else
+      {
+        sample.tick += data[position + 1];
+        position += 2;
+        if (flags & HISTORY_MEASURED)
+        {
+          sample.measured += (int8_t)data[position++];
+        }
+        if (flags & HISTORY_DESIRED)
+        {
+          sample.desired += (int8_t)data[position++];
+        }
+        if (flags & HISTORY_VALVE)
+        {
+          sample.valve += (int8_t)data[position++];
+        }
+        if (flags & HISTORY_RSSI)
+        {
+          sample.rssi += (int8_t)data[position++];
+        }
+      }
+
+      samples[count++] = sample;
+    }
+  }
+
+  return count;
+}
+
+// Samples can't be aged in place like device stamps, so those older than TICK_AGE_MAX are dropped a block at a time
+void ageHistory()
+{
+  for (uint16_t handle = 0; handle < histories.size(); handle++)
+  {
+    history_ring *ring = histories[handle];
+    if (!ring)
+    {
+      continue;
+    }
+
+    if (ticksSince(ring->last.tick) > TICK_AGE_MAX)
+    {
+      memset(ring->used, 0, sizeof(ring->used));
+      continue;
+    }
+
+    // Newest block spans a few hours of deltas at most, ending with the last sample
+    for (byte block = 0; block < HISTORY_BLOCKS; block++)
+    {
+      tick_t tick;
+      memcpy(&tick, ring->blocks[block] + 1, 2);
+      if (block != ring->newest && ring->used[block] && ticksSince(tick) > TICK_AGE_MAX)
+      {
+        ring->used[block] = 0;
+      }
+    }
+  }
+}
+
+unsigned long secondsSinceTick(tick_t tick)
+{
+  return (((unsigned long)ticksSince(tick) << TICK_SHIFT) + (virtualMillis() & TICK_MASK)) / 1000;
+}
+
+// Answers max/<name>/history/get with {"seconds":N} or {"since":epoch}, everything by default
+void publishHistory(state *device, byte *payload, unsigned int length)
+{
+  const int handle = states.handleOf(device);
+  history_sample samples[HISTORY_SAMPLES_MAX];
+  byte count = 0;
+  if (handle >= 0 && handle < histories.size() && histories[handle])
+  {
+    count = decodeHistory(histories[handle], samples);
+  }
+
+  unsigned long seconds = 0xFFFFFFFF;
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + 16> query;
+  if (length && deserializeJson(query, payload, length) == DeserializationError::Ok)
+  {
+    if (query.containsKey("seconds"))
+    {
+      seconds = query["seconds"];
+    }
+    else if (query.containsKey("since") && isTimeSynced() && nowEpoch() >= query["since"].as<unsigned long>())
+    {
+      seconds = nowEpoch() - query["since"].as<unsigned long>();
+    }
+  }
+
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(5) + JSON_ARRAY_SIZE(count) + count * JSON_ARRAY_SIZE(5) + 128);
+  if (isTimeSynced())
+  {
+    doc["time"] = nowEpoch();
+  }
+
+  JsonArray columns = doc.createNestedArray("columns");
+  columns.add("age_s");
+  columns.add("measured_temperature");
+  columns.add("desired_temperature");
+  columns.add("valve_position");
+  columns.add("rssi");
+
+  JsonArray rows = doc.createNestedArray("samples");
+  for (byte i = 0; i < count; i++)
+  {
+    const history_sample *sample = &samples[i];
+    const unsigned long age = secondsSinceTick(sample->tick);
+    if (age > seconds)
+    {
+      continue;
+    }
+
+    JsonArray row = rows.createNestedArray();
+    row.add(age);
+    if (sample->measured == UNDEFINED)
+    {
+      row.add((const char *)0);
+    }
+    else
+    {
+      row.add(TENTHS_TO_JSON(sample->measured));
+    }
+    if (sample->desired == UNDEFINED)
+    {
+      row.add((const char *)0);
+    }
+    else
+    {
+      row.add(TENTHS_TO_JSON(HALVES_TO_TENTHS(sample->desired)));
+    }
+    if (sample->valve == UNDEFINED)
+    {
+      row.add((const char *)0);
+    }
+    else
+    {
+      row.add(sample->valve);
+    }
+    row.add(sample->rssi);
+  }
+
+  // Larger than PubSubClient's buffer, publishTelemetry() streams it
+  char topic[MQTT_TOPIC_MAX];
+  publishTelemetry(deviceTopic(topic, device, "/history"), doc, false);
+}
+
+size_t historyBytes()
+{
+  size_t bytes = histories.capacity() * sizeof(history_ring *);
+  for (uint16_t i = 0; i < histories.size(); i++)
+  {
+    if (histories[i])
+    {
+      bytes += sizeof(history_ring);
+    }
+  }
+
+  return bytes;
+}
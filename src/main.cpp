@@ -14,7 +14,6 @@
 // #include "MaxCC1101.h"
 #include "MaxCC1101.h"
 #include <ESP8266WiFi.h>
-#include <ESP8266WiFiMulti.h>
 #include <ArduinoJson.h>
 #include <ArduinoOTA.h>
 #include <DNSServer.h>
@@ -29,10 +28,38 @@
 #include "time.hpp"
 #include "mqtt.hpp"
 #include "config.hpp"
+#include "capture.hpp"
+#include "replay.hpp"
+#include "fingerprint.hpp"
+#include "commands.hpp"
+#include "device_index.hpp"
+#include "device_pool.hpp"
+#include "rooms.hpp"
+#include "diagnostics.hpp"
+#include "stale_wheel.hpp"
+#include "history.hpp"
+#include "outbox.hpp"
+#include "network.hpp"
+#include "snapshot.hpp"
+#include "bulk.hpp"
+#include "raw.hpp"
 #include "main.hpp"
 
+DebugSerial debug_serial;
+
+size_t DebugSerial::write(uint8_t c)
+{
+  return muted ? 1 : Serial.write(c);
+}
+
+size_t DebugSerial::write(const uint8_t *buffer, size_t size)
+{
+  return muted ? size : Serial.write(buffer, size);
+}
+
 WiFiClient espClient;
-PubSubClient client(espClient);
+MqttTransport mqtt_transport(espClient);
+PubSubClient client(mqtt_transport);
 // client = PubSubClient(espClient);
 // client(espClient);
 
@@ -40,9 +67,7 @@ MaxCC1101 rf;
 
 byte msgCounter = 0;
 
-#define Debug Serial
-
-const int capacity PROGMEM = JSON_OBJECT_SIZE(10) + 256;
+const int capacity PROGMEM = JSON_OBJECT_SIZE(12) + 256;
 
 bool pairing_enabled = false;
 bool autocreate = true;
@@ -52,12 +77,16 @@ bool config_changed = false;
 bool published_started_at_state = false;
 
 bool furnace_running = false;
+
+temperature_t publish_deadband_temperature = PUBLISH_DEADBAND_TEMPERATURE;
+byte publish_deadband_valve = PUBLISH_DEADBAND_VALVE;
+unsigned int publish_heartbeat = PUBLISH_HEARTBEAT;
 char boot_time[20];
 
 byte myAddress[3] = {0x12, 0x34, 0x56};
-std::vector<state> states;
 std::queue<Message> queue;
 std::queue<CC1101Packet> received_messages;
+unsigned long rx_dropped = 0;
 
 String bootedAt;
 
@@ -75,34 +104,6 @@ void stopBurner()
 #endif
 }
 
-ESP8266WiFiMulti wifiMulti;
-
-void setup_wifi()
-{
-  delay(10);
-
-  Serial.println();
-  Serial.print("Connecting to ");
-  Serial.println(WIFI_SSID);
-
-  WiFi.softAPdisconnect(true);
-  wifiMulti.addAP(WIFI_SSID, WIFI_PASSWORD);
-  WiFi.hostname(HOSTNAME);
-
-  randomSeed(micros());
-
-  Serial.println("");
-  Serial.println("WiFi connected");
-  Serial.println("IP address: ");
-  Serial.println(WiFi.localIP());
-
-  if (MDNS.begin(HOSTNAME))
-  {
-    Serial.print("* MDNS responder started. Hostname -> ");
-    Serial.println(HOSTNAME);
-  }
-}
-
 #ifdef CREDIT_15MIN
 unsigned long creditMs = CREDIT_15MIN;
 #endif
@@ -142,6 +143,15 @@ void send(CC1101Packet *packet, bool preamble)
     Debug.print(" with long preamble");
   }
   Debug.printf(": %s\n", buffer);
+
+  if (replaying)
+  {
+    replaySent(packet, preamble);
+    return;
+  }
+
+  captureSent(packet, preamble);
+  rawSent(packet);
   rf.sendData(packet, preamble);
   Debug.println("Done.");
 }
@@ -163,24 +173,33 @@ void sendMessageFromQueue()
     if (takeFromCredit(message->packet.length, message->longPreamble))
     {
       send(&message->packet, message->longPreamble);
+      commandTransmitted(message);
       message->sent = true;
       message->longPreamble = true; // If we don't get ACK on short preamble, retry with long one.
 
       if (!message->waitForAck)
       {
+        commandFrameDone(message, FRAME_SENT);
         queue.pop();
       }
       else if (message->retryCounter++ >= 4)
       {
         // Bail out.
+        configBlockFailed(message);
+        commandFrameDone(message, FRAME_FAILED);
         queue.pop();
       }
-      delay(200);
+
+      if (!replaying)
+      {
+        delay(200);
+      }
     }
     else
     {
       if (!message->waitForAck)
       {
+        commandFrameDone(message, FRAME_FAILED);
         queue.pop();
         Debug.println("Out of credit, not sending. Tossing message away, because not marked as wait for ACK.");
       }
@@ -189,13 +208,28 @@ void sendMessageFromQueue()
   }
 }
 
-void ackMessageInQueue(byte msgcnt)
+// An invalid ACK ends the retries too, but the device didn't take the frame
+void ackMessageInQueue(byte msgcnt, bool accepted)
 {
+  if (queue.empty())
+  {
+    return;
+  }
+
   Message *message = &queue.front();
 
   if (message->sent && message->waitForAck && message->msgcnt == msgcnt)
   {
     Debug.print(", ACKed message in the queue");
+    if (accepted)
+    {
+      configBlockAcked(message);
+    }
+    else
+    {
+      configBlockFailed(message);
+    }
+    commandFrameDone(message, accepted ? FRAME_ACKED : FRAME_FAILED);
     queue.pop();
   }
 }
@@ -224,42 +258,24 @@ unsigned int stringToBytes(byte *data, const char *payload, unsigned int length)
 
 state *findDeviceByAddress(byte *address)
 {
-  state *device;
-  for (int i = 0; i < states.size(); i++)
+  const int position = findDevicePositionByAddress(address);
+  if (position < 0)
   {
-    device = &states[i];
-
-    // Find existing device state or select a new one
-    if ((device->address[0] == address[0] &&
-         device->address[1] == address[1] &&
-         device->address[2] == address[2]))
-    {
-      return device;
-    }
+    return 0;
   }
 
-  return 0;
+  return &states[position];
 }
 
-state *findDeviceByName(String name)
+state *findDeviceByName(const char *name, size_t length)
 {
-  if (name == "")
+  const int position = findDevicePositionByName(name, length);
+  if (position < 0)
   {
     return 0;
   }
 
-  state *device;
-  for (int i = 0; i < states.size(); i++)
-  {
-    device = &states[i];
-
-    if (device->name == name)
-    {
-      return device;
-    }
-  }
-
-  return 0;
+  return &states[position];
 }
 
 void addToQueue(CC1101Packet packet, bool longPreamble = true, bool waitForAck = false)
@@ -271,9 +287,27 @@ void addToQueue(CC1101Packet packet, bool longPreamble = true, bool waitForAck =
   message.waitForAck = waitForAck;
   message.retryCounter = 0;
   message.msgcnt = packet.data[1];
+  tagConfigBlock(&message);
+  tagCommand(&message);
+  if (bulk_staging)
+  {
+    bulk_staging->push_back(message);
+    return;
+  }
   queue.push(message);
 }
 
+// Frame added last, staged ones while a bulk plan is put together
+Message *lastQueuedMessage()
+{
+  if (bulk_staging)
+  {
+    return bulk_staging->empty() ? 0 : &bulk_staging->back();
+  }
+
+  return queue.empty() ? 0 : &queue.back();
+}
+
 bool validateAddress(const char *address)
 {
   return address && strlen(address) == 6;
@@ -309,29 +343,53 @@ void rename(byte *payload)
   {
     Debug.println("Found device to rename...");
     JsonObject root = doc.as<JsonObject>();
-    String newName = root["to"];
+    const char *newName = root["to"] | "";
 
-    if (root.containsKey("to") && newName != device->name)
+    if (!isRoutableName(newName))
     {
-      device->name = newName;
-      String topic = "max/";
-      topic += device->name;
-      topic += "/set";
+      Debug.printf("Not renaming to %s, names have at most %i levels\n", newName, DEVICE_TOPIC_LEVELS);
+      return;
+    }
 
-      Debug.printf("Subscribing to: %s\n", topic.c_str());
-      client.subscribe(topic.c_str(), 1);
+    if (root.containsKey("to") && strcmp(newName, pooledString(device->name)) != 0)
+    {
+      nameDevice(device, newName);
+      // Old name may sit anywhere in the probe sequence, renames are rare enough to start over
+      rebuildDeviceIndex();
+      // Already covered by the max/+/set wildcards, see subscribeRoute()
       config_changed = true;
     }
   }
 }
 
-void setRoom(state *device, String room)
+// Caches the state topic along with the name, deviceTopic() builds it when the pool had no room for it
+void nameDevice(state *device, const char *name)
+{
+  device->topic = STRING_NONE;
+  device->name = internString(name);
+  if (device->name == STRING_NONE)
+  {
+    if (name[0])
+    {
+      Debug.printf("No room in the name pool for %s, not published\n", name);
+    }
+    return;
+  }
+
+  char topic[MQTT_TOPIC_MAX];
+  snprintf(topic, sizeof(topic), "max/%s", name);
+  device->topic = internString(topic);
+}
+
+void setRoom(state *device, const char *room)
 {
-  if (room != device->room)
+  const string_id id = internString(room);
+  if (id != device->room)
   {
-    device->room = room;
+    device->room = id;
+    rebuildRooms();
     config_changed = true;
-    Debug.printf("Assigning room %s\n", room.c_str());
+    Debug.printf("Assigning room %s\n", pooledString(id));
   }
 }
 
@@ -352,7 +410,7 @@ void setGroup(state *device, byte group)
   outMessage.data[11] = group; // new group id
   outMessage.length = 12;
 
-  Debug.printf("Assigning group for %s to ", device->name.c_str());
+  Debug.printf("Assigning group for %s to ", pooledString(device->name));
   Debug.println(group);
   addToQueue(outMessage, true, true);
 
@@ -363,7 +421,7 @@ void setGroup(state *device, byte group)
   }
 }
 
-void setDesiredTemperature(state *device, int mode, float temperature)
+void setDesiredTemperature(state *device, int mode, temperature_t temperature)
 {
   CC1101Packet outMessage;
   outMessage.data[0] = 11; // Length
@@ -377,11 +435,10 @@ void setDesiredTemperature(state *device, int mode, float temperature)
     outMessage.data[7 + i] = device->address[i];
 
   outMessage.data[10] = device->group; // GroupId
-  outMessage.data[11] = (int)(temperature * 2) | (mode << 6);
+  outMessage.data[11] = TENTHS_TO_HALVES(temperature) | (mode << 6);
   outMessage.length = 12;
 
-  Debug.printf("Setting desired temperature of %s to ", device->name.c_str());
-  Debug.println(temperature);
+  Debug.printf("Setting desired temperature of %s to " TEMPERATURE_FORMAT "\n", pooledString(device->name), TEMPERATURE_ARGS(temperature));
 
   addToQueue(outMessage, true, true);
 }
@@ -403,6 +460,22 @@ const char *DAYS[] PROGMEM = {
     "friday",
 };
 
+// Whole degrees stay integer, decimals are parsed once here
+temperature_t jsonToTemperature(JsonVariant value, temperature_t fallback)
+{
+  if (value.isNull())
+  {
+    return fallback;
+  }
+
+  if (value.is<int>())
+  {
+    return value.as<int>() * 10;
+  }
+
+  return round(value.as<float>() * 10);
+}
+
 byte stringToEq3Day(String day)
 {
   day.toLowerCase();
@@ -419,7 +492,7 @@ byte stringToEq3Day(String day)
   return UNDEFINED;
 }
 
-void sendScheduleTo(state *device, byte weekDay, byte *schedule, byte size)
+void sendScheduleTo(state *device, byte weekDay, const byte *schedule, byte size)
 {
   CC1101Packet outMessage;
   outMessage.data[0] = 11 + size; // Length
@@ -438,65 +511,76 @@ void sendScheduleTo(state *device, byte weekDay, byte *schedule, byte size)
 
   outMessage.length = 12 + size;
 
-  Debug.printf("Setting schedule for %s\n", device->name.c_str());
+  const byte block = CONFIG_BLOCK_SCHEDULE + weekDay;
+  const uint32_t print = configFingerprint(outMessage.data + 11, outMessage.length - 11);
+  if (isConfigBlockCurrent(device, block, print))
+  {
+    return;
+  }
+
+  Debug.printf("Setting schedule for %s\n", pooledString(device->name));
 
+  beginConfigBlock(device, block);
   addToQueue(outMessage, true, true);
+  endConfigBlock(print);
 }
 
 void setSchedule(state *device, String day, JsonObject schedule_config)
 {
-  const int count = schedule_config.size();
-  byte schedule[count * 2];
+  byte schedule[DAY_SCHEDULE_LENGTH];
   const byte weekDay = stringToEq3Day(day);
-
-  if (device->schedule[weekDay] != 0)
+  if (weekDay > 6)
   {
-    delete[] device->schedule[weekDay];
+    Debug.printf("Unknown day %s\n", day.c_str());
+    return;
   }
 
-  if (count > 0)
+  byte idx = 0;
+  for (JsonPair p : schedule_config)
   {
-    device->schedule[weekDay] = new byte[count * 2];
-
-    byte idx = 0;
-    for (JsonPair p : schedule_config)
+    if (idx == DAY_SCHEDULE_LENGTH)
     {
-      String hoursMinutes = p.key().c_str();
-      float temperature = p.value().as<float>();
-      const int temperatureInt = temperature * 2;
-      const int colonPos = hoursMinutes.indexOf(":");
-      if (!colonPos)
-      {
-        continue;
-      }
+      Debug.printf("Only %i switch points per day are supported\n", SCHEDULE_POINTS_MAX);
+      break;
+    }
 
-      short h = hoursMinutes.substring(0, colonPos).toInt();
-      short m = hoursMinutes.substring(colonPos + 1, hoursMinutes.length()).toInt();
+    String hoursMinutes = p.key().c_str();
+    const int temperatureInt = TENTHS_TO_HALVES(jsonToTemperature(p.value(), 0));
+    const int colonPos = hoursMinutes.indexOf(":");
+    if (colonPos < 0)
+    {
+      continue;
+    }
 
-      int minuteChunksFromMidnight = (h * 60 + m) / 5;
-      short temperatureWithUntil = temperatureInt << 9 | minuteChunksFromMidnight;
-      schedule[idx] = highByte(temperatureWithUntil);
-      schedule[idx + 1] = lowByte(temperatureWithUntil);
+    short h = hoursMinutes.substring(0, colonPos).toInt();
+    short m = hoursMinutes.substring(colonPos + 1, hoursMinutes.length()).toInt();
 
-      const byte state_schedule_idx = weekDay * DAY_SCHEDULE_LENGTH + idx;
+    int minuteChunksFromMidnight = (h * 60 + m) / 5;
+    short temperatureWithUntil = temperatureInt << 9 | minuteChunksFromMidnight;
+    schedule[idx] = highByte(temperatureWithUntil);
+    schedule[idx + 1] = lowByte(temperatureWithUntil);
 
-      device->schedule[weekDay][idx] = highByte(temperatureWithUntil);
-      device->schedule[weekDay][idx + 1] = lowByte(temperatureWithUntil);
+    idx += 2;
+  }
 
-      idx += 2;
-    }
+  if (!storeDaySchedule(&device->schedule[weekDay], schedule, idx))
+  {
+    // Sending it would leave the device with a schedule the config can't keep
+    Debug.printf("No room for the %s schedule of %s, not sending\n", DAYS[weekDay], pooledString(device->name));
+    failCommand();
+    return;
   }
-  device->schedule_size[weekDay] = count * 2;
+  device->schedule_unstored &= ~(1 << weekDay);
 
   config_changed = true;
-  sendScheduleTo(device, weekDay, schedule, count * 2);
+  sendScheduleTo(device, weekDay, schedule, idx);
 }
 
 bool hasAssociation(state *device, byte *address)
 {
-  for (byte pos = 0; pos < device->associated_devices.size(); pos += 3)
+  for (byte i = 0; i < device->associations; i++)
   {
-    if (memcmp(device->associated_devices.data() + pos, address, 3) == 0)
+    if (memcmp(device->associated_devices[i], address, 3) == 0)
     {
       return true;
     }
@@ -508,7 +592,13 @@ void addAssociation(state *device, byte *address)
 {
   if (!hasAssociation(device, address))
   {
-    device->associated_devices.insert(device->associated_devices.end(), address, address + 3);
+    if (device->associations == ASSOCIATIONS_MAX)
+    {
+      Debug.printf("No space for more associations of %s\n", pooledString(device->name));
+      return;
+    }
+
+    memcpy(device->associated_devices[device->associations++], address, 3);
     config_changed = true;
   }
 }
@@ -548,11 +638,29 @@ void sendAssociateBetween(state *device, state *toDevice)
   }
 }
 
-void associate(state *device, String to)
+bool hasAssociationRoom(state *device, byte *address)
 {
-  state *toDevice = findDeviceByName(to);
+  return device->associations < ASSOCIATIONS_MAX || hasAssociation(device, address);
+}
+
+void associate(state *device, const char *to)
+{
+  if (!to)
+  {
+    return;
+  }
+
+  state *toDevice = findDeviceByName(to, strlen(to));
   if (toDevice)
   {
+    // Linked on the radio but forgotten by the config would never be undone
+    if (!hasAssociationRoom(device, toDevice->address) || !hasAssociationRoom(toDevice, device->address))
+    {
+      Debug.printf("No space for more associations between %s and %s, not linking\n", pooledString(device->name), to);
+      failCommand();
+      return;
+    }
+
     sendAssociateBetween(device, toDevice);
     addAssociation(device, toDevice->address);
     addAssociation(toDevice, device->address);
@@ -560,20 +668,20 @@ void associate(state *device, String to)
 }
 
 // comfort, eco, max, min, window open
-void setTemperatureSettings(state *device, float comfort, float eco, float max, float min, float window_open)
+void setTemperatureSettings(state *device, temperature_t comfort, temperature_t eco, temperature_t max, temperature_t min, temperature_t window_open)
 {
   if (
-      (comfort != device->comfort_temperature) ||
-      (eco != device->eco_temperature) ||
-      (max != device->max_temperature) ||
-      (min != device->min_temperature) ||
-      (window_open != device->window_open_temperature))
-  {
-    device->comfort_temperature = comfort;
-    device->eco_temperature = eco;
-    device->max_temperature = max;
-    device->min_temperature = min;
-    device->window_open_temperature = window_open;
+      (TENTHS_TO_HALVES(comfort) != device->comfort_temperature) ||
+      (TENTHS_TO_HALVES(eco) != device->eco_temperature) ||
+      (TENTHS_TO_HALVES(max) != device->max_temperature) ||
+      (TENTHS_TO_HALVES(min) != device->min_temperature) ||
+      (TENTHS_TO_HALVES(window_open) != device->window_open_temperature))
+  {
+    device->comfort_temperature = TENTHS_TO_HALVES(comfort);
+    device->eco_temperature = TENTHS_TO_HALVES(eco);
+    device->max_temperature = TENTHS_TO_HALVES(max);
+    device->min_temperature = TENTHS_TO_HALVES(min);
+    device->window_open_temperature = TENTHS_TO_HALVES(window_open);
 
     config_changed = true;
   }
@@ -588,19 +696,26 @@ void setTemperatureSettings(state *device, float comfort, float eco, float max,
   for (int i = 0; i < 3; ++i)
     outMessage.data[7 + i] = device->address[i];
   outMessage.data[10] = 0; // GroupId
-  outMessage.data[11] = comfort * 2;
-  outMessage.data[12] = eco * 2;
-  outMessage.data[13] = max * 2;
-  outMessage.data[14] = min * 2;
+  outMessage.data[11] = TENTHS_TO_HALVES(comfort);
+  outMessage.data[12] = TENTHS_TO_HALVES(eco);
+  outMessage.data[13] = TENTHS_TO_HALVES(max);
+  outMessage.data[14] = TENTHS_TO_HALVES(min);
   outMessage.data[15] = 7; // offsset = 0 [7 -> 7/2 - 3.5 = 0]
-  outMessage.data[16] = window_open * 2;
+  outMessage.data[16] = TENTHS_TO_HALVES(window_open);
   outMessage.data[17] = 3; // window open = 15 min [3 -> 3*5 -> 15 (minutes)]
   outMessage.length = 18;
 
-  Debug.printf("Setting temperatures for %s to eco: ", device->name.c_str());
-  Debug.println(eco);
+  const uint32_t print = configFingerprint(outMessage.data + 11, outMessage.length - 11);
+  if (isConfigBlockCurrent(device, CONFIG_BLOCK_TEMPERATURES, print))
+  {
+    return;
+  }
+
+  Debug.printf("Setting temperatures for %s to eco: " TEMPERATURE_FORMAT "\n", pooledString(device->name), TEMPERATURE_ARGS(eco));
 
+  beginConfigBlock(device, CONFIG_BLOCK_TEMPERATURES);
   addToQueue(outMessage, true, true);
+  endConfigBlock(print);
 }
 
 void setDisplayActualTemperatureState(state *device, bool display_actual_temperature)
@@ -649,9 +764,17 @@ void configValveFunctions(state *device, byte decalc_weekday = 0, byte decalc_ho
   outMessage.data[14] = valve_offset * 255 / 100;
   outMessage.length = 15;
 
-  Debug.printf("Setting valve config for %s\n", device->name.c_str());
+  const uint32_t print = configFingerprint(outMessage.data + 11, outMessage.length - 11);
+  if (isConfigBlockCurrent(device, CONFIG_BLOCK_VALVE, print))
+  {
+    return;
+  }
 
+  Debug.printf("Setting valve config for %s\n", pooledString(device->name));
+
+  beginConfigBlock(device, CONFIG_BLOCK_VALVE);
   addToQueue(outMessage, true, true);
+  endConfigBlock(print);
 }
 
 void displayActualTemperature(state *device, bool isEnabled)
@@ -669,10 +792,19 @@ void displayActualTemperature(state *device, bool isEnabled)
   outMessage.data[11] = isEnabled ? 4 : 0;
   outMessage.length = 12;
 
-  Debug.printf("Setting display actual temperature for %s to %i\n", device->name.c_str(), isEnabled);
   setDisplayActualTemperatureState(device, isEnabled);
 
+  const uint32_t print = configFingerprint(outMessage.data + 11, outMessage.length - 11);
+  if (isConfigBlockCurrent(device, CONFIG_BLOCK_DISPLAY, print))
+  {
+    return;
+  }
+
+  Debug.printf("Setting display actual temperature for %s to %i\n", pooledString(device->name), isEnabled);
+
+  beginConfigBlock(device, CONFIG_BLOCK_DISPLAY);
   addToQueue(outMessage, true, true);
+  endConfigBlock(print);
 }
 
 void setAddress(const char *address)
@@ -725,21 +857,69 @@ void setSelf(byte *payload)
       config_changed = true;
       publishState();
     }
+    else if (key == "capture")
+    {
+      setCaptureSink(stringToCaptureSink(value));
+      config_changed = true;
+    }
+    else if (key == "deadband_temperature")
+    {
+      publish_deadband_temperature = jsonToTemperature(value, PUBLISH_DEADBAND_TEMPERATURE);
+      config_changed = true;
+    }
+    else if (key == "deadband_valve")
+    {
+      publish_deadband_valve = value;
+      config_changed = true;
+    }
+    else if (key == "heartbeat")
+    {
+      publish_heartbeat = value;
+      config_changed = true;
+    }
+    else if (key == "raw")
+    {
+      raw_enabled = value;
+      config_changed = true;
+    }
+    else if (key == "raw_frames")
+    {
+      raw_batch_frames = constrain(value.as<int>(), 1, 255);
+      config_changed = true;
+    }
+    else if (key == "raw_interval")
+    {
+      raw_batch_interval = value;
+      config_changed = true;
+    }
+    else if (key == "format")
+    {
+      telemetry_format = stringToPayloadFormat(value);
+      config_changed = true;
+      publishState();
+    }
+    else if (key == "snapshot")
+    {
+      snapshot_enabled = value;
+      markSnapshotDirty();
+      config_changed = true;
+      publishState();
+    }
   }
 }
 
 void publishState()
 {
   StaticJsonDocument<capacity> doc;
-  char output[128];
   doc["availability"] = "online";
   doc["booted_at"] = bootedAt;
   doc["pairing_enabled"] = pairing_enabled;
   doc["autocreate"] = autocreate;
   doc["furnace_running"] = furnace_running;
+  doc["snapshot"] = snapshot_enabled;
+  doc["format"] = payloadFormatToString(telemetry_format);
 
-  serializeJson(doc, output);
-  if (client.publish("max", output, true))
+  if (publishJson("max", doc, true))
   {
     published_started_at_state = true;
   }
@@ -753,11 +933,20 @@ void set(state *device, byte *payload)
 
   if (error)
   {
-    Serial.println("Cannot parse payload.");
+    Debug.println("Cannot parse payload.");
     return;
   }
 
   JsonObject root = doc.as<JsonObject>();
+
+  beginCommand(device, root);
+  applySet(device, root);
+  endCommand();
+}
+
+// Queues what a max/<name>/set payload asks for, shared with max/bulk/set
+void applySet(state *device, JsonObject root)
+{
   int mode = device->mode || MODE_MANUAL;
 
   if (root.containsKey("mode"))
@@ -772,11 +961,11 @@ void set(state *device, byte *payload)
       root.containsKey("min_temperature") ||
       root.containsKey("window_open_temperature"))
   {
-    float eco_temperature = root["eco_temperature"] | device->eco_temperature;
-    float comfort_temperature = root["comfort_temperature"] | device->comfort_temperature;
-    float max_temperature = root["max_temperature"] | device->max_temperature;
-    float min_temperature = root["min_temperature"] | device->min_temperature;
-    float window_open_temperature = root["window_open_temperature"] | device->window_open_temperature;
+    temperature_t eco_temperature = jsonToTemperature(root["eco_temperature"], HALVES_TO_TENTHS(device->eco_temperature));
+    temperature_t comfort_temperature = jsonToTemperature(root["comfort_temperature"], HALVES_TO_TENTHS(device->comfort_temperature));
+    temperature_t max_temperature = jsonToTemperature(root["max_temperature"], HALVES_TO_TENTHS(device->max_temperature));
+    temperature_t min_temperature = jsonToTemperature(root["min_temperature"], HALVES_TO_TENTHS(device->min_temperature));
+    temperature_t window_open_temperature = jsonToTemperature(root["window_open_temperature"], HALVES_TO_TENTHS(device->window_open_temperature));
 
     setTemperatureSettings(device, comfort_temperature, eco_temperature, max_temperature, min_temperature, window_open_temperature);
   }
@@ -828,7 +1017,7 @@ void set(state *device, byte *payload)
 
     if (key == "room")
     {
-      setRoom(device, value);
+      setRoom(device, value.as<const char *>());
     }
     else if (key == "group")
     {
@@ -843,69 +1032,42 @@ void set(state *device, byte *payload)
     }
     else if (key == "temperature" || key == "desired_temperature")
     {
-      setDesiredTemperature(device, mode, value);
+      setDesiredTemperature(device, mode, jsonToTemperature(value, 0));
     }
     else if (key == "mode" && !root.containsKey("temperature") && !root.containsKey("desired_temperature"))
     {
       // Set just mode and reuse old desired temperature
-      setDesiredTemperature(device, mode, device->desired_temperature);
+      setDesiredTemperature(device, mode, HALVES_TO_TENTHS(device->desired_temperature));
     }
     else if (key == "associate")
     {
-      associate(device, value);
+      associate(device, value.as<const char *>());
     }
     else if (key == "display_actual_temperature")
     {
       displayActualTemperature(device, value);
     }
+    else if (key == "resync" && value.as<bool>())
+    {
+      // Device lost its config (e.g. factory reset without re-pairing), send everything again
+      forgetConfigBlocks(device);
+      sendConfigurationTo(device);
+    }
   }
 }
 
-void callback(String topic, byte *payload, unsigned int length)
+void callback(char *topic, byte *payload, unsigned int length)
 {
   Debug.println("Handling MQTT message...");
-  topic.toLowerCase();
-  if (topic == "max/rename")
-  {
-    rename(payload);
-  }
-  else if (topic == "max/format")
-  {
-    format();
-  }
-  else if (topic == "max/reset")
+  // PubSubClient's buffer, lower case it in place instead of copying into a String
+  for (char *c = topic; *c; c++)
   {
-    ESP.reset();
+    *c = tolower(*c);
   }
-  else if (topic == "max/set")
-  {
-    setSelf(payload);
-  }
-  else if (topic.startsWith("max/") && topic.endsWith("/set"))
-  {
-    String name = topic.substring(4, topic.length() - 4);
-    state *device = findDeviceByName(name);
-    if (device)
-    {
-      set(device, payload);
-    }
-  }
-}
 
-void subscribeToDeviceSetTopics()
-{
-  state *device;
-  for (int i; i < states.size(); i++)
+  if (!routeMessage(topic, payload, length))
   {
-    device = &states[i];
-    if (device->name != "")
-    {
-      String topic = "max/";
-      topic += device->name;
-      topic += "/set";
-      Serial.printf("Subscribing to: %s\n", topic.c_str());
-      client.subscribe(topic.c_str(), 1);
-    }
+    Debug.printf("No route for %s\n", topic);
   }
 }
 
@@ -915,9 +1077,9 @@ void rfinit()
 {
   lastCommand = millis();
   rf.init();
-  Serial.println("Init receive!");
+  Debug.println("Init receive!");
   rf.initReceive();
-  Serial.println("Done");
+  Debug.println("Done");
 }
 
 void ICACHE_RAM_ATTR messageReceivedInterrupt()
@@ -937,19 +1099,23 @@ void setup(void)
 #endif
   stopBurner();
 
+  // Empty wheel even when there's no config to load devices from
+  rebuildStaleWheel();
   loadConfig();
+  // When there was no config to count devices from
+  setupScheduleArena(states.size());
+  setupOutbox(states.size());
 
-  Serial.println("Setting up time...");
+  Debug.println("Setting up time...");
   setupTime();
-  Serial.println("Finished.");
-  bootedAt = String(ntp.formattedTime("%Y-%m-%d %H:%M:%S"));
+  Debug.println("Finished.");
+  bootedAt = String(formatTime("%Y-%m-%d %H:%M:%S"));
 
-  client.setServer(MQTT_SERVER, 1883);
-  client.setCallback(callback);
+  setupMqtt();
 
-  Serial.println("RF Init");
+  Debug.println("RF Init");
   rfinit();
-  Serial.println("RF Init done");
+  Debug.println("RF Init done");
   pinMode(CC1101_IRQ_PIN, INPUT);
   attachInterrupt(CC1101_IRQ_PIN, messageReceivedInterrupt, RISING);
 }
@@ -980,11 +1146,13 @@ bool sendCurrentTimeTo(byte *address, byte msgcnt = 0, byte group = 0, bool long
   outMessage.data[9] = address[2];
   outMessage.data[10] = group; // GroupId
 
-  outMessage.data[11] = ntp.year() - 2000;
-  outMessage.data[12] = ntp.day();
-  outMessage.data[13] = ntp.hours();
-  outMessage.data[14] = ntp.minutes() | ((ntp.month() & 0x0C) << 4);
-  outMessage.data[15] = ntp.seconds() | ((ntp.month() & 0x03) << 6);
+  const struct tm now = localTime();
+  const byte month = now.tm_mon + 1;
+  outMessage.data[11] = now.tm_year + 1900 - 2000;
+  outMessage.data[12] = now.tm_mday;
+  outMessage.data[13] = now.tm_hour;
+  outMessage.data[14] = now.tm_min | ((month & 0x0C) << 4);
+  outMessage.data[15] = now.tm_sec | ((month & 0x03) << 6);
 
   outMessage.length = 16;
 
@@ -998,6 +1166,23 @@ bool sendCurrentTimeTo(byte *address, byte msgcnt = 0, byte group = 0, bool long
 
 unsigned long last_time_sync_to_devices = millis();
 byte time_sync_device_chunk = 0;
+unsigned long last_aged_at = millis();
+
+void ageTimestamps()
+{
+  last_aged_at = millis();
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    state *device = &states[handle];
+    ageTick(device->timestamp);
+    ageTick(device->desired_temperature_timestamp);
+    ageTick(device->measured_temperature_timestamp);
+    ageTick(device->valve_timestamp);
+    ageTick(device->mode_timestamp);
+    ageTick(device->published_at);
+  }
+  ageHistory();
+}
 
 #define TIME_SYNC_CHUNKS 6
 void syncTimeToDevices()
@@ -1005,7 +1190,7 @@ void syncTimeToDevices()
   last_time_sync_to_devices = millis();
   state *device;
   Debug.printf("Syncing time to chunk number %i\n", time_sync_device_chunk);
-  for (int i; i < states.size(); i++)
+  for (int i = 0; i < states.size(); i++)
   {
     device = &states[i];
     if (i % TIME_SYNC_CHUNKS == time_sync_device_chunk && (device->type == DEVICE_HEATING_THERMOSTAT || device->type == DEVICE_WALL_THERMOSTAT))
@@ -1022,11 +1207,18 @@ void syncTimeToDevices()
 
 void loop(void)
 {
-  wifiMulti.run();
   static unsigned long last_credited_at = millis();
-  ArduinoOTA.handle();
+
+  // Network upkeep, none of it waits for a connection that isn't there
+  const unsigned long network_started_at = micros();
+  wifiLoop();
+  if (isWifiUp())
+  {
+    ArduinoOTA.handle();
+  }
+  mqttLoop();
+  noteNetworkTime(micros() - network_started_at);
   yield();
-  ntp.update();
 
   if (millis() > 10 * 24 * 60 * 60 * 1000) {
     Debug.println("******** Restarting after 10 days!");
@@ -1042,8 +1234,15 @@ void loop(void)
 
   sendMessageFromQueue();
   yield();
-  mqttLoop();
+  outboxLoop();
+  snapshotLoop();
   yield();
+  captureLoop();
+  rawLoop();
+  replayLoop();
+  commandsLoop();
+  diagnosticsLoop();
+  staleLoop();
 
 #ifdef CREDIT_15MIN
   if (millis() - last_credited_at > 15 * 60 * 1000)
@@ -1060,6 +1259,11 @@ void loop(void)
     saveConfig();
   }
 
+  if (millis() - last_aged_at > TICK_AGE_INTERVAL)
+  {
+    ageTimestamps();
+  }
+
   // Sync time to device chunk every hour
   if (millis() - last_time_sync_to_devices > 60 * 60 * 1000)
   {
@@ -1074,7 +1278,7 @@ void loop(void)
 
   syncValvesToWallThermostats();
 
-  const int heating_needed = isHeatingNeeded();
+  const int heating_needed = heatingDemand();
   if (heating_needed == RUN)
   {
     startBurner();
@@ -1123,6 +1327,12 @@ void checkForNewPacket()
 
   if (rf.receiveData(&message))
   {
+    // Frames pile up while a replay batch or a slow publish holds the loop, the oldest are what matters least
+    if (received_messages.size() >= RX_QUEUE_MAX)
+    {
+      received_messages.pop();
+      rx_dropped++;
+    }
     received_messages.push(message);
   }
 }
@@ -1150,7 +1360,7 @@ void getBytes(byte (&arr)[N], CC1101Packet *packet, unsigned int position)
 
 #define bitCopy(from, to, bit) (bitWrite(to, bit, bitRead(from, bit)))
 
-String modeToString(int mode) {
+const char *modeToString(int mode) {
   switch (mode) {
     case MODE_AUTO:
       return "auto";
@@ -1185,7 +1395,7 @@ int stringToMode(String mode)
   }
 }
 
-String typeToString(int type)
+const char *typeToString(int type)
 {
   switch (type)
   {
@@ -1208,6 +1418,7 @@ void setType(state *device, int type)
   {
     Debug.printf("Device type %i is different from a new type %i\n", device->type, type);
     device->type = type;
+    rebuildRooms();
     config_changed = true;
   }
 }
@@ -1216,11 +1427,11 @@ void setMode(state *device, int mode)
 {
   if (mode != device->mode)
   {
-    device->mode_changed_timestamp = millis();
+    device->mode_changed_at = virtualMillis();
   }
 
   device->mode = mode;
-  device->mode_timestamp = millis();
+  device->mode_timestamp = nowTicks();
 }
 
 bool compareAddress(byte *first, const byte *second)
@@ -1228,10 +1439,10 @@ bool compareAddress(byte *first, const byte *second)
   return first[0] == second[0] && first[1] == second[1] && first[2] == second[2];
 }
 
-#define STALE_DURATION 10 * 60 * 1000
-bool isFresh(unsigned long last_time)
+// ageTimestamps() keeps 16-bit stamps from wrapping around into looking fresh
+bool isFresh(tick_t last_time)
 {
-  return (millis() - last_time) <= STALE_DURATION;
+  return ticksSince(last_time) <= STALE_TICKS;
 }
 
 void sendAckTo(byte *address, byte msgcnt = 0)
@@ -1256,84 +1467,77 @@ void sendAckTo(byte *address, byte msgcnt = 0)
   addToQueue(outMessage, false);
 }
 
-void parseDateTime(CC1101Packet *packet, short offset)
-{
-  byte until[3];
-  getBytes(until, packet, offset);
+#define SEQUENCE_RESET_GAP 64
 
-  short day = until[0] & 0x1F;
-  short month = ((until[0] & 0xE0) >> 4) | (until[1] >> 7);
-  short year = until[1] & 0x3F + 2000;
-  short minutes = 0;
-  short minute30Chunks = until[2] & 0x3F;
-
-  if (minute30Chunks % 2)
-  {
-    minutes = 30;
-  }
-
-  short hours = minute30Chunks / 2;
-
-  Serial.printf("%i.%i.%i %i:%i", day, month, year, hours, minutes);
-}
-
-state *findWallThermostatByRoom(String room)
+// Count frames we missed or got twice from gaps in device's own message counter
+void trackSequence(state *device, byte command, byte msgcnt)
 {
-  if (room == "")
+  // ACK reuses msgcnt of the message being acknowledged
+  if (command == ACK_CMD)
   {
-    return 0;
+    return;
   }
 
-  state *device;
-  for (int i = 0; i < states.size(); i++)
+  if (device->last_msgcnt != UNDEFINED)
   {
-    device = &states[i];
+    const byte gap = msgcnt - device->last_msgcnt;
 
-    if (device->type == DEVICE_WALL_THERMOSTAT && device->room == room)
+    if (gap == 0)
     {
-      return device;
+      device->frames_duplicate++;
+      return;
     }
+    else if (gap <= SEQUENCE_RESET_GAP)
+    {
+      device->frames_lost += gap - 1;
+    }
+    // Larger gap means the counter restarted, e.g. after battery change
+  }
+
+  if (device->frames_received == 0xFFFF)
+  {
+    // Keeps the loss rate, weighted towards recent frames
+    device->frames_received /= 2;
+    device->frames_lost /= 2;
+    device->frames_duplicate /= 2;
   }
 
-  return 0;
+  device->frames_received++;
+  device->last_msgcnt = msgcnt;
 }
 
-void syncValvesToWallThermostats()
+float lossRate(state *device)
 {
-  state *device;
-  // Clear valve position info
-  for (int i = 0; i < states.size(); i++)
-  {
-    device = &states[i];
+  const unsigned int expected = device->frames_received + device->frames_lost;
+  return expected ? (float)device->frames_lost / expected : 0;
+}
 
-    if (device->type == DEVICE_WALL_THERMOSTAT)
-    {
-      device->valve_position = UNDEFINED;
-    }
-  }
+void parseDateTime(CC1101Packet *packet, short offset)
+{
+  byte until[3];
+  getBytes(until, packet, offset);
 
-  for (int i = 0; i < states.size(); i++)
+  short day = until[0] & 0x1F;
+  short month = ((until[0] & 0xE0) >> 4) | (until[1] >> 7);
+  short year = until[1] & 0x3F + 2000;
+  short minutes = 0;
+  short minute30Chunks = until[2] & 0x3F;
+
+  if (minute30Chunks % 2)
   {
-    device = &states[i];
+    minutes = 30;
+  }
 
-    if (device->type == DEVICE_HEATING_THERMOSTAT)
-    {
-      state *thermostat = findWallThermostatByRoom(device->room);
+  short hours = minute30Chunks / 2;
 
-      if (thermostat && isFresh(device->valve_timestamp) && device->valve_position > thermostat->valve_position)
-      {
-        thermostat->valve_position = device->valve_position;
-        thermostat->valve_timestamp = device->valve_timestamp;
-      }
-    }
-  }
+  Debug.printf("%i.%i.%i %i:%i", day, month, year, hours, minutes);
 }
 
 const byte MINIMUM_VALVE_POSITION_TO_HEAT PROGMEM = 53;
-const float HEAT_END_OFFSET PROGMEM = -0.2;
-const float HEAT_START_OFFSET PROGMEM = -0.4;
+const temperature_t HEAT_END_OFFSET PROGMEM = -2;   // Tenths
+const temperature_t HEAT_START_OFFSET PROGMEM = -4; // Tenths
 
-int compareTemperature(float measured_temperature, float desired_temperature)
+int compareTemperature(temperature_t measured_temperature, temperature_t desired_temperature)
 {
   if (measured_temperature == UNDEFINED || desired_temperature == UNDEFINED)
   {
@@ -1367,6 +1571,35 @@ unsigned long boost_duration_chunks_to_ms(byte boost_duration)
   return minutes * 60 * 1000;
 }
 
+// Decision only changes on received state, when the stale wheel expires a field or when a boost ends
+bool heating_dirty = true;
+int heating_decision = STOP;
+bool heating_recheck_scheduled = false;
+unsigned long heating_recheck_at = 0;
+
+void scheduleHeatingRecheck(unsigned long at)
+{
+  if (!heating_recheck_scheduled || (long)(at - heating_recheck_at) < 0)
+  {
+    heating_recheck_at = at;
+    heating_recheck_scheduled = true;
+  }
+}
+
+void markHeatingDirty()
+{
+  heating_dirty = true;
+}
+
+// Everything of a device isHeatingNeeded() looks at, packed to compare before and after a frame
+uint64_t heatingInputs(state *device)
+{
+  return (uint64_t)(byte)device->type << 56 | (uint64_t)(byte)device->mode << 48 |
+         (uint64_t)(byte)device->valve_position << 40 | (uint64_t)(byte)device->desired_temperature << 32 |
+         (uint64_t)(uint16_t)device->measured_temperature << 16 | (uint64_t)(device->fresh & FRESH_FIELDS) << 8 |
+         device->associations;
+}
+
 int isHeatingNeeded()
 {
   // -1 Stop
@@ -1374,13 +1607,14 @@ int isHeatingNeeded()
   //  1 Run
 
   int result = STOP;
+  heating_recheck_scheduled = false;
 
   state *device;
   for (int i = 0; i < states.size(); i++)
   {
     device = &states[i];
 
-    if (!isFresh(device->timestamp) || device->mode == UNDEFINED)
+    if (device->mode == UNDEFINED || !(device->fresh & FRESH_SEEN))
     {
       continue;
     }
@@ -1388,19 +1622,20 @@ int isHeatingNeeded()
     if (device->type == DEVICE_HEATING_THERMOSTAT)
     {
       // Ignore devices with binded thermostat
-      state *thermostat = findWallThermostatByRoom(device->room);
-      if (thermostat)
+      if (findWallThermostatOf(device))
       {
         continue;
       }
     }
 
-    if (device->mode == MODE_BOOST && millis() - device->mode_changed_timestamp < boost_duration_chunks_to_ms(device->boost_duration) - TWO_MINUTES)
+    const unsigned long boost_ms = boost_duration_chunks_to_ms(device->boost_duration) - TWO_MINUTES;
+    if (device->mode == MODE_BOOST && virtualMillis() - device->mode_changed_at < boost_ms)
     {
+      scheduleHeatingRecheck(device->mode_changed_at + boost_ms);
       return RUN;
     }
 
-    if (!isFresh(device->desired_temperature_timestamp) || !isFresh(device->measured_temperature_timestamp))
+    if (!(device->fresh & FRESH_DESIRED) || !(device->fresh & FRESH_MEASURED))
     {
       continue;
     }
@@ -1410,16 +1645,27 @@ int isHeatingNeeded()
         (device->type == DEVICE_WALL_THERMOSTAT || (device->type == DEVICE_HEATING_THERMOSTAT && device->mode == MODE_MANUAL)) &&
         device->valve_position > MINIMUM_VALVE_POSITION_TO_HEAT)
     {
-      result = max(result, compareTemperature(device->measured_temperature, device->desired_temperature));
+      result = max(result, compareTemperature(device->measured_temperature, HALVES_TO_TENTHS(device->desired_temperature)));
     }
   }
 
   return result;
 }
 
+int heatingDemand()
+{
+  if (heating_dirty || (heating_recheck_scheduled && (long)(virtualMillis() - heating_recheck_at) >= 0))
+  {
+    heating_dirty = false;
+    heating_decision = isHeatingNeeded();
+  }
+
+  return heating_decision;
+}
+
 void sendConfigurationTo(state *device)
 {
-  Debug.printf("Restoring configuration for %s after factory reset.\n", device->name.c_str());
+  Debug.printf("Restoring configuration for %s after factory reset.\n", pooledString(device->name));
 
   sendCurrentTimeTo(device->address, msgCounter++, device->group, true);
 
@@ -1430,29 +1676,141 @@ void sendConfigurationTo(state *device)
   }
 
   configValveFunctions(device, device->decalc_weekday, device->decalc_hour, device->boost_duration, device->boost_valve_position, device->max_valve_setting, device->valve_offset);
-  setTemperatureSettings(device, device->comfort_temperature, device->eco_temperature, device->max_temperature, device->min_temperature, device->window_open_temperature);
+  setTemperatureSettings(
+      device,
+      HALVES_TO_TENTHS(device->comfort_temperature),
+      HALVES_TO_TENTHS(device->eco_temperature),
+      HALVES_TO_TENTHS(device->max_temperature),
+      HALVES_TO_TENTHS(device->min_temperature),
+      HALVES_TO_TENTHS(device->window_open_temperature));
 
   // Restore associations
-  for (byte pos = 0; pos < device->associated_devices.size(); pos += 3)
+  const uint32_t print = configFingerprint(device->associated_devices[0], device->associations * 3);
+  if (device->associations > 0 && !isConfigBlockCurrent(device, CONFIG_BLOCK_ASSOCIATIONS, print))
   {
-    state *toDevice = findDeviceByAddress(device->associated_devices.data() + pos);
-
-    if (toDevice)
+    beginConfigBlock(device, CONFIG_BLOCK_ASSOCIATIONS);
+    for (byte i = 0; i < device->associations; i++)
     {
-      sendAssociateBetween(device, toDevice);
+      state *toDevice = findDeviceByAddress(device->associated_devices[i]);
+
+      if (toDevice)
+      {
+        sendAssociateBetween(device, toDevice);
+      }
     }
+    endConfigBlock(print);
   }
 
   // Restore schedule
   for (byte weekDay = 0; weekDay < 7; weekDay++)
   {
-    if (device->schedule_size[weekDay] > 0)
+    if (device->schedule[weekDay] != SCHEDULE_NONE)
     {
-      sendScheduleTo(device, weekDay, device->schedule[weekDay], device->schedule_size[weekDay]);
+      sendScheduleTo(device, weekDay, daySchedule(device->schedule[weekDay]), dayScheduleSize(device->schedule[weekDay]));
     }
   }
 }
 
+// Same document goes to max/<name> and into max/snapshot
+void buildStateDocument(state *device, JsonDocument &doc)
+{
+  if (device->type != UNDEFINED)
+  {
+    doc["type"] = typeToString(device->type);
+  }
+  if (device->room != STRING_NONE)
+  {
+    doc["room"] = pooledString(device->room);
+  }
+  if (device->mode != UNDEFINED)
+  {
+    doc["mode"] = modeToString(device->mode);
+  }
+  if (device->measured_temperature != UNDEFINED)
+  {
+    doc["measured_temperature"] = TENTHS_TO_JSON(device->measured_temperature);
+  }
+
+  if (device->desired_temperature != UNDEFINED)
+  {
+    doc["desired_temperature"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->desired_temperature));
+  }
+
+  if (device->valve_position != UNDEFINED)
+  {
+    doc["valve_position"] = device->valve_position;
+  }
+
+  if (device->is_open != UNDEFINED)
+  {
+    doc["open"] = (bool)device->is_open;
+  }
+
+  if (device->low_battery != UNDEFINED)
+  {
+    doc["low_battery"] = (bool)device->low_battery;
+  }
+
+  if (device->rf_error != UNDEFINED)
+  {
+    doc["rf_error"] = (bool)device->rf_error;
+  }
+  doc["rssi"] = device->rssi;
+  if (device->frames_received > 0)
+  {
+    doc["loss_rate"] = round(lossRate(device) * 1000) / 1000.0;
+  }
+}
+
+bool exceedsDeadband(int value, int published, int deadband)
+{
+  if (value == published)
+  {
+    return false;
+  }
+
+  // Appearing or disappearing always counts
+  if (value == UNDEFINED || published == UNDEFINED)
+  {
+    return true;
+  }
+
+  return abs(value - published) >= deadband;
+}
+
+// Fields published without deadband, kept whole so no change can hide behind a hash collision
+void stateFields(state *device, byte *fields)
+{
+  fields[0] = device->type;
+  fields[1] = device->room;
+  fields[2] = device->mode;
+  fields[3] = device->desired_temperature;
+  fields[4] = device->is_open;
+  fields[5] = device->low_battery;
+  fields[6] = device->rf_error;
+  fields[7] = device->name;
+}
+
+bool isStatePublishDue(state *device)
+{
+  byte fields[STATE_FIELDS];
+  stateFields(device, fields);
+
+  return memcmp(device->published_fields, fields, STATE_FIELDS) != 0 ||
+         ticksSince(device->published_at) >= MILLIS_TO_TICKS(publish_heartbeat * 1000UL) ||
+         exceedsDeadband(device->measured_temperature, device->published_measured_temperature, publish_deadband_temperature) ||
+         exceedsDeadband(device->valve_position, device->published_valve_position, publish_deadband_valve);
+}
+
+void markStatePublished(state *device)
+{
+  stateFields(device, device->published_fields);
+  device->published_at = nowTicks();
+  device->published_measured_temperature = device->measured_temperature;
+  device->published_valve_position = device->valve_position;
+  markSnapshotDirty();
+}
+
 void handle(CC1101Packet *packet)
 {
   char buffer[packet->length * 2 + 1];
@@ -1463,13 +1821,6 @@ void handle(CC1101Packet *packet)
   Debug.print(packet->length, DEC);
   Debug.print(", ");
 
-  bool crcOK = packet->data[0] == packet->length - 3;
-  if (!crcOK)
-  {
-    Debug.println("CRC NOT OK");
-    return;
-  }
-
   int rssi = getByte(packet, packet->length - 2);
 
   if (rssi >= 128)
@@ -1480,9 +1831,17 @@ void handle(CC1101Packet *packet)
   {
     rssi = rssi / 2 - 74;
   }
+  rawReceived(packet, rssi);
+
+  bool crcOK = packet->data[0] == packet->length - 3;
+  if (!crcOK)
+  {
+    Debug.println("CRC NOT OK");
+    captureReceived(packet, rssi, CAPTURE_BAD_LENGTH);
+    return;
+  }
 
   Debug.printf("CRC OK, RSSI %i\n", rssi);
-  // client.publish("max/raw", buffer);
 
   lastCommand = millis();
 
@@ -1497,21 +1856,24 @@ void handle(CC1101Packet *packet)
 
   const bool isToMyself = compareAddress(dst, myAddress);
 
-  state *device = findDeviceByAddress(src);
-  if (!device)
+  int position = findDevicePositionByAddress(src);
+  if (position < 0)
   {
     if (autocreate || pairing_enabled)
     {
-      states.push_back(state());
-      device = &states.back();
+      position = states.add();
+      memcpy(states[position].address, src, 3);
+      indexDevice(position);
     }
     else
     {
       // Ignore device
+      captureReceived(packet, rssi, CAPTURE_IGNORED);
       return;
     }
   }
 
+  state *device = &states[position];
   device->address[0] = src[0];
   device->address[1] = src[1];
   device->address[2] = src[2];
@@ -1521,16 +1883,22 @@ void handle(CC1101Packet *packet)
   bytesToString(address, device->address, 3);
   bytesToString(dstAddress, dst, 3);
 
-  if (device->name == "")
+  if (device->name == STRING_NONE)
   {
-    device->name = address;
+    nameDevice(device, address);
+    indexDeviceName(position);
     config_changed = true;
   }
 
-  Debug.printf("Message from: %s (%s) to %s (group %i), msgcnt: %i, command: %i\n", device->name.c_str(), address, dstAddress, group, msgcnt, command);
+  Debug.printf("Message from: %s (%s) to %s (group %i), msgcnt: %i, command: %i\n", pooledString(device->name), address, dstAddress, group, msgcnt, command);
 
-  device->timestamp = millis();
+  // Most frames repeat what the device said before, those leave the heating decision alone
+  const uint64_t heating_inputs = heatingInputs(device);
+  device->timestamp = nowTicks();
+  trackSequence(device, command, msgcnt);
+  device->rssi = constrain(rssi, -128, 0);
 
+  byte capture_result = CAPTURE_DECODED;
   switch (command)
   {
   case TIME_INFORMATION_CMD:
@@ -1550,7 +1918,8 @@ void handle(CC1101Packet *packet)
     setType(device, DEVICE_HEATING_THERMOSTAT);
     short valve_position = getByte(packet, 12);
     device->valve_position = valve_position;
-    device->valve_timestamp = millis();
+    device->valve_timestamp = nowTicks();
+    markRoomDirty(device);
   }
   case WALL_THERMOSTAT_STATE_CMD:
   {
@@ -1579,16 +1948,12 @@ void handle(CC1101Packet *packet)
 
     byte displayActualTemperature = getByte(packet, 12);
     byte desiredTemperatureRaw = getByte(packet, 13);
-    float desiredTemperature = (desiredTemperatureRaw & 0x7F) / 2.0;
-    float measuredTemperature = (((getByte(packet, 14) & 0x01) << 8) + getByte(packet, 15)) / 10.0;
-    device->desired_temperature = desiredTemperature;
-    device->desired_temperature_timestamp = millis();
-    device->measured_temperature = measuredTemperature;
-    device->measured_temperature_timestamp = millis();
-    Debug.print("STATE/Desired Temperature: ");
-    Debug.print(desiredTemperature, 1);
-    Debug.print(" Measured temperature: ");
-    Debug.println(measuredTemperature, 1);
+    device->desired_temperature = desiredTemperatureRaw & 0x7F;
+    device->desired_temperature_timestamp = nowTicks();
+    device->measured_temperature = ((getByte(packet, 14) & 0x01) << 8) + getByte(packet, 15);
+    device->measured_temperature_timestamp = nowTicks();
+    Debug.printf("STATE/Desired Temperature: " TEMPERATURE_FORMAT " Measured temperature: " TEMPERATURE_FORMAT "\n",
+                 TEMPERATURE_ARGS(HALVES_TO_TENTHS(device->desired_temperature)), TEMPERATURE_ARGS(device->measured_temperature));
     // TODO: implement until?
     break;
   }
@@ -1624,7 +1989,7 @@ void handle(CC1101Packet *packet)
     if (isToMyself)
     {
       Debug.print(", is to myself");
-      ackMessageInQueue(msgcnt);
+      ackMessageInQueue(msgcnt, payload == ACK_OK);
     }
 
     if (device->type == DEVICE_HEATING_THERMOSTAT)
@@ -1632,23 +1997,21 @@ void handle(CC1101Packet *packet)
       short valve_position = getByte(packet, 13);
       Debug.printf(", valve_position: %i", valve_position);
       device->valve_position = valve_position;
-      device->valve_timestamp = millis();
+      device->valve_timestamp = nowTicks();
+      markRoomDirty(device);
 
       byte desiredTemperatureRaw = getByte(packet, 14);
-      float desiredTemperature = (desiredTemperatureRaw & 0x7F) / 2.0;
-      device->desired_temperature = desiredTemperature;
-      device->desired_temperature_timestamp = millis();
-      Debug.printf(", desired temperature: ");
-      Debug.print(desiredTemperature);
+      device->desired_temperature = desiredTemperatureRaw & 0x7F;
+      device->desired_temperature_timestamp = nowTicks();
+      Debug.printf(", desired temperature: " TEMPERATURE_FORMAT, TEMPERATURE_ARGS(HALVES_TO_TENTHS(device->desired_temperature)));
     }
     else if (device->type == DEVICE_WALL_THERMOSTAT)
     {
       byte displayActualTemperature = getByte(packet, 13);
       setDisplayActualTemperatureState(device, displayActualTemperature);
       byte desiredTemperatureRaw = getByte(packet, 14);
-      float desiredTemperature = (desiredTemperatureRaw & 0x7F) / 2.0;
-      device->desired_temperature = desiredTemperature;
-      device->desired_temperature_timestamp = millis();
+      device->desired_temperature = desiredTemperatureRaw & 0x7F;
+      device->desired_temperature_timestamp = nowTicks();
 
       if (displayActualTemperature == DISPLAY_CURRENT_SETPOINT)
       {
@@ -1658,8 +2021,7 @@ void handle(CC1101Packet *packet)
       {
         Debug.print(", display actual temperature");
       }
-      Debug.printf(", desired temperature: ");
-      Debug.print(desiredTemperature);
+      Debug.printf(", desired temperature: " TEMPERATURE_FORMAT, TEMPERATURE_ARGS(HALVES_TO_TENTHS(device->desired_temperature)));
     }
     Debug.println();
     break;
@@ -1668,16 +2030,12 @@ void handle(CC1101Packet *packet)
   {
     setType(device, DEVICE_WALL_THERMOSTAT);
 
-    float desiredTemperature = (getByte(packet, 11) & 0x7F) / 2.0;
-    float measuredTemperature = (((getByte(packet, 11) & 0x80) << 1) + getByte(packet, 12)) / 10.0;
-    device->desired_temperature = desiredTemperature;
-    device->desired_temperature_timestamp = millis();
-    device->measured_temperature = measuredTemperature;
-    device->measured_temperature_timestamp = millis();
-    Serial.print("Control/Desired Temperature:  ");
-    Serial.print(desiredTemperature);
-    Serial.print(" Measured temperature: ");
-    Serial.println(measuredTemperature);
+    device->desired_temperature = getByte(packet, 11) & 0x7F;
+    device->desired_temperature_timestamp = nowTicks();
+    device->measured_temperature = ((getByte(packet, 11) & 0x80) << 1) + getByte(packet, 12);
+    device->measured_temperature_timestamp = nowTicks();
+    Debug.printf("Control/Desired Temperature:  " TEMPERATURE_FORMAT " Measured temperature: " TEMPERATURE_FORMAT "\n",
+                  TEMPERATURE_ARGS(HALVES_TO_TENTHS(device->desired_temperature)), TEMPERATURE_ARGS(device->measured_temperature));
     break;
   }
   case SHUTTER_CONTACT_STATE_CMD:
@@ -1709,15 +2067,13 @@ void handle(CC1101Packet *packet)
     short mode = modeAndTemperature >> 6;
     setMode(device, mode);
 
-    float desiredTemperature = (modeAndTemperature & 0x3F) / 2.0;
-    device->desired_temperature = desiredTemperature;
-    device->desired_temperature_timestamp = millis();
+    device->desired_temperature = modeAndTemperature & 0x3F;
+    device->desired_temperature_timestamp = nowTicks();
 
     // Date until, only in case of vacation mode
     // parseDateTime(packet, 14);
 
-    Debug.printf("Set temperature, mode %i, desired_temperature: ", mode);
-    Debug.println(desiredTemperature);
+    Debug.printf("Set temperature, mode %i, desired_temperature: " TEMPERATURE_FORMAT "\n", mode, TEMPERATURE_ARGS(HALVES_TO_TENTHS(device->desired_temperature)));
     if (isToMyself)
     {
       sendAckTo(src, msgcnt);
@@ -1756,9 +2112,10 @@ void handle(CC1101Packet *packet)
       Debug.println(", responding with PairPong.");
       addToQueue(outMessage, false);
 
-      // Paring of a new device or after factory reset
+      // Paring of a new device or after factory reset, a reset device remembers none of the config it ACKed
       if (!isToMyself)
       {
+        forgetConfigBlocks(device);
         sendConfigurationTo(device);
       }
     }
@@ -1766,61 +2123,37 @@ void handle(CC1101Packet *packet)
     {
       Debug.println();
     }
+    break;
   }
-  }
-
-  syncValvesToWallThermostats();
-
-  char output[256];
-
-  StaticJsonDocument<capacity> doc;
-
-  if (device->type != UNDEFINED)
-  {
-    doc["type"] = typeToString(device->type);
-  }
-  if (device->room != "")
-  {
-    doc["room"] = device->room;
-  }
-  if (device->mode != UNDEFINED)
-  {
-    doc["mode"] = modeToString(device->mode);
-  }
-  if (device->measured_temperature != UNDEFINED)
-  {
-    doc["measured_temperature"] = device->measured_temperature;
-  }
-
-  if (device->desired_temperature != UNDEFINED)
+  default:
   {
-    doc["desired_temperature"] = device->desired_temperature;
+    capture_result = CAPTURE_UNKNOWN_COMMAND;
   }
-
-  if (device->valve_position != UNDEFINED)
-  {
-    doc["valve_position"] = device->valve_position;
   }
 
-  if (device->is_open != UNDEFINED)
+  captureReceived(packet, rssi, capture_result);
+  refreshDevice(position);
+  if (heatingInputs(device) != heating_inputs)
   {
-    doc["open"] = (bool)device->is_open;
+    markHeatingDirty();
   }
+  recordHistory(position, rssi);
+  syncValvesToWallThermostats();
 
-  if (device->low_battery != UNDEFINED)
+  // ACKs and repeated state frames usually change nothing worth a retained publish
+  if (replaying || device->name == STRING_NONE || !isStatePublishDue(device))
   {
-    doc["low_battery"] = (bool)device->low_battery;
+    return;
   }
 
-  if (device->rf_error != UNDEFINED)
+  char topic[MQTT_TOPIC_MAX];
+  StaticJsonDocument<capacity> doc;
+  buildStateDocument(device, doc);
+  if (publishTelemetry(deviceTopic(topic, device, ""), doc, true))
   {
-    doc["rf_error"] = (bool)device->rf_error;
+    markStatePublished(device);
   }
-  doc["rssi"] = rssi;
-  serializeJson(doc, output);
-  String topic = "max/";
-  topic += device->name;
-  client.publish(topic.c_str(), output, true);
 
-  Debug.println(output);
+  serializeJson(doc, Debug);
+  Debug.println();
 }
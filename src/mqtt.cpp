@@ -1,42 +1,587 @@
 #include "main.hpp"
+#include "configuration.h"
+#include "config.hpp"
+#include "capture.hpp"
+#include "replay.hpp"
+#include "diagnostics.hpp"
+#include "fingerprint.hpp"
+#include "history.hpp"
+#include "stale_wheel.hpp"
+#include "outbox.hpp"
+#include "network.hpp"
+#include "bulk.hpp"
+#include "mqtt.hpp"
+#include <lwip/dns.h>
 
-void mqttReconnect()
+typedef void (*route_handler)(byte *payload, unsigned int length);
+typedef void (*device_route_handler)(state *device, byte *payload, unsigned int length);
+
+typedef struct
+{
+  const char *topic;
+  route_handler handler;
+  bool wildcard; // Already delivered through a device route subscription, not subscribed again
+} route;
+
+typedef struct
+{
+  const char *suffix;
+  device_route_handler handler;
+} device_route;
+
+void routeRename(byte *payload, unsigned int length) { rename(payload); }
+void routeSaveConfig(byte *payload, unsigned int length) { saveConfig(); }
+void routeFormat(byte *payload, unsigned int length) { format(); }
+void routeReset(byte *payload, unsigned int length) { ESP.reset(); }
+void routeSetSelf(byte *payload, unsigned int length) { setSelf(payload); }
+void routeCaptureDump(byte *payload, unsigned int length) { dumpCapture(); }
+void routeReplayEnd(byte *payload, unsigned int length) { endReplay(); }
+void routeDiagnostics(byte *payload, unsigned int length) { publishDiagnostics(); }
+void routeSet(state *device, byte *payload, unsigned int length) { set(device, payload); }
+
+const route ROUTES[] PROGMEM = {
+    {"max/rename", routeRename},
+    {"max/save-config", routeSaveConfig},
+    {"max/format", routeFormat},
+    {"max/reset", routeReset},
+    {"max/set", routeSetSelf},
+    {"max/capture/dump", routeCaptureDump},
+    {"max/replay", replay},
+    {"max/replay/end", routeReplayEnd},
+    {"max/diagnostics/get", routeDiagnostics},
+    {"max/bulk/set", bulkSet, true},
+};
+#define ROUTES_COUNT (sizeof(ROUTES) / sizeof(route))
+
+// max/<name><suffix>, names may contain up to DEVICE_TOPIC_LEVELS levels
+const device_route DEVICE_ROUTES[] PROGMEM = {
+    {"/set", routeSet},
+    {"/history/get", publishHistory},
+};
+#define DEVICE_ROUTES_COUNT (sizeof(DEVICE_ROUTES) / sizeof(device_route))
+
+unsigned long publish_count = 0;
+unsigned long publish_us = 0;
+byte telemetry_format = PAYLOAD_JSON;
+
+const char *PAYLOAD_FORMATS[] PROGMEM = {
+    "json",
+    "msgpack",
+};
+
+byte stringToPayloadFormat(const char *format)
 {
-  if (!client.connected())
+  if (format && strcmp(format, PAYLOAD_FORMATS[PAYLOAD_MSGPACK]) == 0)
   {
-    Serial.print("Attempting MQTT connection...");
-    // Create a random client ID
-    String clientId = "max-";
-    clientId += String(random(0xffff), HEX);
-    // Attempt to connect
-    if (client.connect(clientId.c_str(), "max", 1, true, "{\"availability\":\"offline\"}"))
+    return PAYLOAD_MSGPACK;
+  }
+
+  return PAYLOAD_JSON;
+}
+
+const char *payloadFormatToString(byte format)
+{
+  return PAYLOAD_FORMATS[format == PAYLOAD_MSGPACK ? PAYLOAD_MSGPACK : PAYLOAD_JSON];
+}
+
+// Collects ArduinoJson's small writes on the stack before they go to the socket
+class PublishWriter : public Print
+{
+public:
+  size_t write(uint8_t c) override
+  {
+    buffer[length++] = c;
+    if (length == PUBLISH_CHUNK)
     {
-      Serial.println("connected");
-      // ... and resubscribe
-      client.publish("max", "{\"availability\":\"online\"}", true);
-      client.subscribe("max/rename", 1);
-      client.subscribe("max/save-config", 1);
-      client.subscribe("max/format", 1);
-      client.subscribe("max/reset", 1);
-      client.subscribe("max/set", 1);
+      send();
+    }
+    return 1;
+  }
 
-      subscribeToDeviceSetTopics();
+  void send()
+  {
+    client.write(buffer, length);
+    length = 0;
+  }
+
+private:
+  byte buffer[PUBLISH_CHUNK];
+  byte length = 0;
+};
+
+// max/<name><suffix>, the state topic straight from the cache, the rest built on the caller's stack
+const char *deviceTopic(char *buffer, state *device, const char *suffix)
+{
+  if (device->topic == STRING_NONE)
+  {
+    snprintf(buffer, MQTT_TOPIC_MAX, "max/%s%s", pooledString(device->name), suffix);
+    return buffer;
+  }
+
+  if (!suffix[0])
+  {
+    return pooledString(device->topic);
+  }
+
+  snprintf(buffer, MQTT_TOPIC_MAX, "%s%s", pooledString(device->topic), suffix);
+  return buffer;
+}
+
+PublishWriter stream_writer;
+
+// For messages put together from several documents, length must be known upfront
+bool beginStream(const char *topic, size_t length, bool retained)
+{
+  return client.beginPublish(topic, length, retained);
+}
+
+void streamJson(const JsonDocument &doc)
+{
+  serializeJson(doc, stream_writer);
+}
+
+void streamText(const char *text)
+{
+  while (*text)
+  {
+    stream_writer.write(*text++);
+  }
+}
+
+bool endStream()
+{
+  stream_writer.send();
+  return client.endPublish();
+}
+
+// Serializes straight into the MQTT packet, no intermediate buffer and no heap.
+// While the broker is away or older messages wait, it goes to the outbox instead.
+bool publishDocument(const char *topic, const JsonDocument &doc, bool retained, byte format)
+{
+  const unsigned long start = micros();
+  const size_t length = format == PAYLOAD_MSGPACK ? measureMsgPack(doc) : measureJson(doc);
+  if (!isMqttReady() || !isOutboxEmpty())
+  {
+    byte *destination = reserveOutbox(topic, length, retained);
+    if (!destination)
+    {
+      return false;
+    }
+    if (format == PAYLOAD_MSGPACK)
+    {
+      serializeMsgPack(doc, (char *)destination, length);
     }
     else
     {
-      Serial.print("failed, rc=");
-      Serial.println(client.state());
+      serializeJson(doc, (char *)destination, length + 1);
+    }
+    return true;
+  }
+
+  if (!client.beginPublish(topic, length, retained))
+  {
+    return false;
+  }
+
+  PublishWriter writer;
+  if (format == PAYLOAD_MSGPACK)
+  {
+    serializeMsgPack(doc, writer);
+  }
+  else
+  {
+    serializeJson(doc, writer);
+  }
+  writer.send();
+  const bool published = client.endPublish();
+
+  publish_count++;
+  publish_us += micros() - start;
+  return published;
+}
+
+bool publishJson(const char *topic, const JsonDocument &doc, bool retained)
+{
+  return publishDocument(topic, doc, retained, PAYLOAD_JSON);
+}
+
+// Device state, history and metrics, in the format picked in the main config
+bool publishTelemetry(const char *topic, const JsonDocument &doc, bool retained)
+{
+  return publishDocument(topic, doc, retained, telemetry_format);
+}
+
+bool publishText(const char *topic, const char *payload, bool retained)
+{
+  if (!isMqttReady() || !isOutboxEmpty())
+  {
+    return queueOutbox(topic, (const byte *)payload, strlen(payload), retained);
+  }
+
+  return client.publish(topic, payload, retained);
+}
+
+// Ahead of anything waiting in the outbox, whose older retained copies for the topic are dropped
+bool publishTextNow(const char *topic, const char *payload, bool retained)
+{
+  if (retained)
+  {
+    supersedeOutbox(topic);
+  }
+
+  return client.publish(topic, payload, retained);
+}
+
+unsigned long publishCount()
+{
+  return publish_count;
+}
+
+unsigned long publishMicros()
+{
+  return publish_us;
+}
+
+// Fixed topics by hash, open addressing, index + 1 and 0 for empty
+byte route_table[ROUTE_TABLE_SIZE];
+
+uint16_t topicHash(const char *topic, size_t length)
+{
+  return fingerprint((const byte *)topic, length);
+}
+
+void setupRouter()
+{
+  memset(route_table, 0, sizeof(route_table));
+  for (byte i = 0; i < ROUTES_COUNT; i++)
+  {
+    uint16_t slot = topicHash(ROUTES[i].topic, strlen(ROUTES[i].topic)) & (ROUTE_TABLE_SIZE - 1);
+    while (route_table[slot])
+    {
+      slot = (slot + 1) & (ROUTE_TABLE_SIZE - 1);
+    }
+    route_table[slot] = i + 1;
+  }
+}
+
+// Topic is lower case already, see callback()
+bool routeMessage(const char *topic, byte *payload, unsigned int length)
+{
+  const size_t topicLength = strlen(topic);
+
+  uint16_t slot = topicHash(topic, topicLength) & (ROUTE_TABLE_SIZE - 1);
+  while (route_table[slot])
+  {
+    const route *entry = &ROUTES[route_table[slot] - 1];
+    if (strcmp(entry->topic, topic) == 0)
+    {
+      entry->handler(payload, length);
+      return true;
     }
+    slot = (slot + 1) & (ROUTE_TABLE_SIZE - 1);
+  }
+
+  if (topicLength <= 4 || strncmp(topic, "max/", 4) != 0)
+  {
+    return false;
+  }
+
+  for (byte i = 0; i < DEVICE_ROUTES_COUNT; i++)
+  {
+    const device_route *entry = &DEVICE_ROUTES[i];
+    const size_t suffixLength = strlen(entry->suffix);
+    if (topicLength <= 4 + suffixLength || strcmp(topic + topicLength - suffixLength, entry->suffix) != 0)
+    {
+      continue;
+    }
+
+    // Name index is hashed too
+    state *device = findDeviceByName(topic + 4, topicLength - 4 - suffixLength);
+    if (device)
+    {
+      entry->handler(device, payload, length);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Same SUBSCRIBE packets however many devices there are
+// Deeper names would still publish, but no subscription would deliver their commands
+bool isRoutableName(const char *name)
+{
+  byte levels = 1;
+  for (const char *c = name; *c; c++)
+  {
+    if (*c == '/')
+    {
+      levels++;
+    }
+  }
+
+  return levels <= DEVICE_TOPIC_LEVELS;
+}
+
+byte subscriptionCount()
+{
+  return ROUTES_COUNT + DEVICE_ROUTES_COUNT * DEVICE_TOPIC_LEVELS;
+}
+
+bool subscribeRoute(byte index)
+{
+  if (index < ROUTES_COUNT)
+  {
+    return ROUTES[index].wildcard || client.subscribe(ROUTES[index].topic, 1);
+  }
+
+  // max/+/<suffix>, max/+/+/<suffix>, ...
+  index -= ROUTES_COUNT;
+  char filter[MQTT_TOPIC_MAX];
+  strcpy(filter, "max");
+  for (byte level = 0; level <= index % DEVICE_TOPIC_LEVELS; level++)
+  {
+    strcat(filter, "/+");
+  }
+  strcat(filter, DEVICE_ROUTES[index / DEVICE_TOPIC_LEVELS].suffix);
+
+  return client.subscribe(filter, 1);
+}
+
+#define MQTT_WILL_TOPIC "max"
+#define MQTT_WILL_MESSAGE "{\"availability\":\"offline\"}"
+
+byte mqtt_step = MQTT_WAIT;
+unsigned long mqtt_step_at = 0;
+unsigned long mqtt_backoff = 0; // First attempt right away
+unsigned long mqtt_tcp_timeout = MQTT_TCP_TIMEOUT_MIN;
+bool mqtt_resolved = false;
+IPAddress mqtt_server_ip;
+byte mqtt_subscribed = 0;
+char mqtt_client_id[10];
+
+// Bumped per lookup, so an answer arriving after its lookup timed out is dropped
+uintptr_t mqtt_lookup = 0;
+volatile bool mqtt_lookup_done = false;
+
+void setupMqtt()
+{
+  setupRouter();
+  client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
+  client.setCallback(callback);
+}
+
+bool isMqttReady()
+{
+  return mqtt_step == MQTT_READY;
+}
+
+void setMqttStep(byte step)
+{
+  mqtt_step = step;
+  mqtt_step_at = millis();
+}
+
+void mqttFailed(const char *step)
+{
+  Debug.printf("MQTT %s failed, rc=%i\n", step, client.state());
+  client.disconnect();
+  espClient.stop();
+
+  // Exponential with jitter, so a restarted broker isn't hit by every client at once
+  mqtt_backoff = mqtt_backoff ? min(mqtt_backoff * 2, (unsigned long)MQTT_BACKOFF_MAX) : MQTT_BACKOFF_MIN;
+  mqtt_backoff += random(mqtt_backoff / 4);
+  setMqttStep(MQTT_WAIT);
+}
+
+// Called by lwIP once the DNS server answered, or with no address when it didn't
+void serverResolved(const char *name, const ip_addr_t *address, void *lookup)
+{
+  if ((uintptr_t)lookup != mqtt_lookup)
+  {
+    return;
+  }
+
+  if (address)
+  {
+    mqtt_server_ip = IPAddress(address);
+    mqtt_resolved = true;
+  }
+  mqtt_lookup_done = true;
+}
+
+bool startLookup()
+{
+  ip_addr_t address;
+  mqtt_lookup++;
+  mqtt_lookup_done = false;
+
+  switch (dns_gethostbyname(MQTT_SERVER, &address, serverResolved, (void *)mqtt_lookup))
+  {
+  case ERR_OK: // Cached or an IP address already
+    serverResolved(MQTT_SERVER, &address, (void *)mqtt_lookup);
+    return true;
+  case ERR_INPROGRESS:
+    return true;
+  default:
+    return false;
   }
 }
 
+void writeString(byte *packet, size_t &length, const char *string)
+{
+  const size_t stringLength = strlen(string);
+  packet[length++] = stringLength >> 8;
+  packet[length++] = stringLength;
+  memcpy(packet + length, string, stringLength);
+  length += stringLength;
+}
+
+// The same MQTT 3.1.1 CONNECT PubSubClient::connect() builds, written without waiting for the CONNACK
+bool sendConnect()
+{
+  byte packet[64];
+  size_t length = 5; // Room for the fixed header
+  const byte variableHeader[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04,
+                                 0x2E, // Clean session, retained will at QoS 1
+                                 MQTT_KEEPALIVE >> 8, MQTT_KEEPALIVE & 0xFF};
+  memcpy(packet + length, variableHeader, sizeof(variableHeader));
+  length += sizeof(variableHeader);
+  writeString(packet, length, mqtt_client_id);
+  writeString(packet, length, MQTT_WILL_TOPIC);
+  writeString(packet, length, MQTT_WILL_MESSAGE);
+
+  // Remaining length is under 128, a single byte
+  packet[3] = 0x10;
+  packet[4] = length - 5;
+  return espClient.write(packet + 3, length - 3) == length - 3;
+}
+
+// Everything else since CONNACK goes through the outbox until announced, see isMqttReady()
+void announce()
+{
+  client.publish("max", "{\"availability\":\"online\"}", true);
+  publishAvailabilities(true);
+  mqtt_backoff = 0;
+  Debug.println("MQTT connected");
+}
+
+// One step per loop pass, polled until done or timed out, so frames keep being handled while the broker is away
 void mqttLoop()
 {
-  static unsigned long last_mqtt_reconnect = millis();
-  if (!client.connected() && WiFi.status() == WL_CONNECTED && millis() - last_mqtt_reconnect > 1000)
+  if (mqtt_step == MQTT_READY)
   {
-    mqttReconnect();
-    last_mqtt_reconnect = millis();
+    if (!client.loop())
+    {
+      mqttFailed("connection");
+    }
+    return;
   }
-  client.loop();
-}
\ No newline at end of file
+
+  if (!isWifiUp())
+  {
+    if (mqtt_step != MQTT_WAIT)
+    {
+      client.disconnect();
+      setMqttStep(MQTT_WAIT);
+    }
+    return;
+  }
+
+  switch (mqtt_step)
+  {
+  case MQTT_WAIT:
+    if (millis() - mqtt_step_at < mqtt_backoff)
+    {
+      break;
+    }
+    if (mqtt_resolved)
+    {
+      setMqttStep(MQTT_TCP);
+      break;
+    }
+    if (!startLookup())
+    {
+      mqttFailed("resolve");
+      break;
+    }
+    setMqttStep(MQTT_RESOLVE);
+    break;
+  case MQTT_RESOLVE:
+    if (mqtt_resolved)
+    {
+      setMqttStep(MQTT_TCP);
+    }
+    else if (mqtt_lookup_done || millis() - mqtt_step_at >= MQTT_DNS_TIMEOUT)
+    {
+      mqtt_lookup++;
+      mqttFailed("resolve");
+    }
+    break;
+  case MQTT_TCP:
+    // WiFiClient has no asynchronous connect, so this waits, but only about a round trip to a broker on the LAN
+    espClient.setTimeout(mqtt_tcp_timeout);
+    if (!espClient.connect(mqtt_server_ip, MQTT_PORT))
+    {
+      // Broker may have moved, or the network is slower than the timeout
+      mqtt_resolved = false;
+      mqtt_tcp_timeout = min(mqtt_tcp_timeout * 2, (unsigned long)MQTT_TCP_TIMEOUT_MAX);
+      mqttFailed("TCP connect");
+      break;
+    }
+    mqtt_tcp_timeout = max(mqtt_tcp_timeout / 2, (unsigned long)MQTT_TCP_TIMEOUT_MIN);
+    snprintf(mqtt_client_id, sizeof(mqtt_client_id), "max-%lx", random(0xffff));
+    if (!sendConnect())
+    {
+      mqttFailed("CONNECT");
+      break;
+    }
+    setMqttStep(MQTT_SESSION);
+    break;
+  case MQTT_SESSION:
+  {
+    // Polled until the whole CONNACK is in, then PubSubClient::connect() reads it without waiting
+    if (espClient.available() < 4)
+    {
+      if (!espClient.connected() || millis() - mqtt_step_at >= MQTT_CONNACK_TIMEOUT)
+      {
+        mqttFailed("CONNACK");
+      }
+      break;
+    }
+
+    client.setServer(mqtt_server_ip, MQTT_PORT);
+    mqtt_transport.muted = true;
+    const bool connected = client.connect(mqtt_client_id, MQTT_WILL_TOPIC, 1, true, MQTT_WILL_MESSAGE);
+    mqtt_transport.muted = false;
+    if (!connected)
+    {
+      mqttFailed("CONNECT");
+      break;
+    }
+    mqtt_subscribed = 0;
+    setMqttStep(MQTT_SUBSCRIBE);
+    break;
+  }
+  case MQTT_SUBSCRIBE:
+    for (byte i = 0; i < MQTT_SUBSCRIBE_BATCH; i++)
+    {
+      if (mqtt_subscribed == subscriptionCount())
+      {
+        setMqttStep(MQTT_ANNOUNCE);
+        break;
+      }
+      if (!subscribeRoute(mqtt_subscribed++))
+      {
+        mqttFailed("SUBSCRIBE");
+        break;
+      }
+    }
+    client.loop();
+    break;
+  case MQTT_ANNOUNCE:
+    setMqttStep(MQTT_READY);
+    announce();
+    break;
+  }
+}
@@ -0,0 +1,107 @@
+#include "Arduino.h"
+#include <ESP8266WiFi.h>
+#include <ESP8266mDNS.h>
+#include "configuration.h"
+#include "network.hpp"
+#include "main.hpp"
+
+WiFiEventHandler wifi_got_ip_handler;
+WiFiEventHandler wifi_disconnected_handler;
+
+// Written from SDK events, which run between loop() passes
+volatile bool wifi_up = false;
+volatile bool wifi_came_up = false;
+unsigned long wifi_down_since = 0;
+unsigned long wifi_disconnected_ms = 0;
+unsigned long wifi_disconnects = 0;
+unsigned long wifi_retried_at = 0;
+unsigned long wifi_checked_at = 0;
+
+unsigned long network_us = 0;
+unsigned long network_max_us = 0;
+
+void onWifiGotIP(const WiFiEventStationModeGotIP &event)
+{
+  wifi_up = true;
+  wifi_came_up = true;
+}
+
+void onWifiDisconnected(const WiFiEventStationModeDisconnected &event)
+{
+  if (wifi_up)
+  {
+    wifi_disconnects++;
+    wifi_down_since = millis();
+    // The SDK gets its own go at reconnecting before the station is restarted
+    wifi_retried_at = millis();
+  }
+  wifi_up = false;
+}
+
+// Doesn't wait for the connection, the SDK reconnects on its own and wifiLoop() watches over it
+void setup_wifi()
+{
+  Debug.println();
+  Debug.print("Connecting to ");
+  Debug.println(WIFI_SSID);
+
+  wifi_got_ip_handler = WiFi.onStationModeGotIP(onWifiGotIP);
+  wifi_disconnected_handler = WiFi.onStationModeDisconnected(onWifiDisconnected);
+
+  WiFi.persistent(false);
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+  WiFi.hostname(HOSTNAME);
+  WiFi.setAutoReconnect(true);
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  wifi_down_since = millis();
+  wifi_retried_at = millis();
+
+  randomSeed(micros());
+
+  if (MDNS.begin(HOSTNAME))
+  {
+    Debug.print("* MDNS responder started. Hostname -> ");
+    Debug.println(HOSTNAME);
+  }
+}
+
+bool isWifiUp()
+{
+  return wifi_up;
+}
+
+void wifiLoop()
+{
+  if (wifi_came_up)
+  {
+    wifi_came_up = false;
+    wifi_disconnected_ms += millis() - wifi_down_since;
+    Debug.print("WiFi connected, IP address: ");
+    Debug.println(WiFi.localIP());
+  }
+
+  if (wifi_up || millis() - wifi_checked_at < WIFI_CHECK_INTERVAL)
+  {
+    return;
+  }
+  wifi_checked_at = millis();
+
+  if (millis() - wifi_retried_at > WIFI_RETRY_INTERVAL)
+  {
+    Debug.println("WiFi still down, restarting the station");
+    wifi_retried_at = millis();
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  }
+}
+
+void noteNetworkTime(unsigned long us)
+{
+  network_us += us;
+  network_max_us = max(network_max_us, us);
+}
+
+unsigned long wifiDisconnectedSeconds()
+{
+  return (wifi_disconnected_ms + (wifi_up ? 0 : millis() - wifi_down_since)) / 1000;
+}
@@ -0,0 +1,190 @@
+#include "Arduino.h"
+#include "outbox.hpp"
+#include "main.hpp"
+#include "mqtt.hpp"
+
+byte *outbox = 0;
+size_t outbox_size = 0;
+size_t outbox_length = 0;
+unsigned long outbox_drained_at = 0;
+
+unsigned long outbox_buffered = 0;
+unsigned long outbox_coalesced = 0;
+unsigned long outbox_dropped = 0;
+
+outbox_entry *outboxEntryAt(size_t offset)
+{
+  return (outbox_entry *)(outbox + offset);
+}
+
+const char *outboxTopic(outbox_entry *entry)
+{
+  return (const char *)entry + sizeof(outbox_entry);
+}
+
+const byte *outboxPayload(outbox_entry *entry)
+{
+  return (const byte *)entry + sizeof(outbox_entry) + entry->topic_length + 1;
+}
+
+// Once, after the config is loaded, so it never fragments the heap
+void setupOutbox(size_t devices)
+{
+  const size_t size = constrain(devices * OUTBOX_DEVICE_BYTES, (size_t)OUTBOX_MIN_SIZE, (size_t)OUTBOX_MAX_SIZE);
+  outbox = (byte *)malloc(size); // 4 byte aligned, like the entries
+  outbox_size = outbox ? size : 0;
+  Debug.printf("Outbox of %u bytes for %u devices\n", (unsigned)outbox_size, (unsigned)devices);
+}
+
+bool isOutboxEmpty()
+{
+  return outbox_length == 0;
+}
+
+void removeOldestOutboxEntry()
+{
+  const uint16_t length = outboxEntryAt(0)->length;
+  memmove(outbox, outbox + length, outbox_length - length);
+  outbox_length -= length;
+}
+
+// Superseded entries give their room back before live ones are dropped
+void compactOutbox()
+{
+  size_t kept = 0;
+  for (size_t offset = 0; offset < outbox_length;)
+  {
+    const uint16_t length = outboxEntryAt(offset)->length;
+    if (!(outboxEntryAt(offset)->flags & OUTBOX_DEAD))
+    {
+      if (kept != offset)
+      {
+        memmove(outbox + kept, outbox + offset, length);
+      }
+      kept += length;
+    }
+    offset += length;
+  }
+  outbox_length = kept;
+}
+
+// Queued retained messages for topic are stale once a newer one is queued or sent
+void supersedeOutbox(const char *topic)
+{
+  for (size_t offset = 0; offset < outbox_length; offset += outboxEntryAt(offset)->length)
+  {
+    outbox_entry *entry = outboxEntryAt(offset);
+    if ((entry->flags & (OUTBOX_RETAINED | OUTBOX_DEAD)) == OUTBOX_RETAINED && strcmp(outboxTopic(entry), topic) == 0)
+    {
+      entry->flags |= OUTBOX_DEAD;
+      outbox_coalesced++;
+    }
+  }
+}
+
+// Room for a payload of length bytes plus a NUL, filled in by the caller. 0 when it can never fit.
+byte *reserveOutbox(const char *topic, unsigned int length, bool retained)
+{
+  const size_t topicLength = strlen(topic);
+  // Entries stay 4 byte aligned for the header
+  const size_t entryLength = (sizeof(outbox_entry) + topicLength + 1 + length + 1 + 3) & ~3;
+  if (topicLength > 0xFF || entryLength > outbox_size / 2)
+  {
+    outbox_dropped++;
+    return 0;
+  }
+
+  if (retained)
+  {
+    supersedeOutbox(topic);
+  }
+
+  if (outbox_length + entryLength > outbox_size)
+  {
+    compactOutbox();
+  }
+
+  // Then the oldest go first, they are the most likely to be superseded soon anyway
+  while (outbox_length + entryLength > outbox_size)
+  {
+    outbox_dropped++;
+    removeOldestOutboxEntry();
+  }
+
+  outbox_entry *entry = outboxEntryAt(outbox_length);
+  entry->length = entryLength;
+  entry->payload_length = length;
+  entry->flags = retained ? OUTBOX_RETAINED : 0;
+  entry->topic_length = topicLength;
+  memcpy((byte *)entry + sizeof(outbox_entry), topic, topicLength + 1);
+  outbox_length += entryLength;
+  outbox_buffered++;
+
+  return (byte *)outboxPayload(entry);
+}
+
+bool queueOutbox(const char *topic, const byte *payload, unsigned int length, bool retained)
+{
+  byte *destination = reserveOutbox(topic, length, retained);
+  if (!destination)
+  {
+    return false;
+  }
+
+  memcpy(destination, payload, length);
+  return true;
+}
+
+// Drains at a controlled rate, so a backlog doesn't starve the radio and the broker
+void outboxLoop()
+{
+  if (outbox_length == 0 || !isMqttReady() || millis() - outbox_drained_at < OUTBOX_DRAIN_INTERVAL)
+  {
+    return;
+  }
+  outbox_drained_at = millis();
+
+  for (byte sent = 0; sent < OUTBOX_DRAIN_BATCH && outbox_length > 0;)
+  {
+    outbox_entry *entry = outboxEntryAt(0);
+    if (!(entry->flags & OUTBOX_DEAD))
+    {
+      if (!client.beginPublish(outboxTopic(entry), entry->payload_length, entry->flags & OUTBOX_RETAINED))
+      {
+        return;
+      }
+      client.write(outboxPayload(entry), entry->payload_length);
+      if (!client.endPublish())
+      {
+        return;
+      }
+      sent++;
+    }
+
+    removeOldestOutboxEntry();
+  }
+}
+
+uint16_t outboxCount()
+{
+  uint16_t count = 0;
+  for (size_t offset = 0; offset < outbox_length; offset += outboxEntryAt(offset)->length)
+  {
+    if (!(outboxEntryAt(offset)->flags & OUTBOX_DEAD))
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+size_t outboxBytes()
+{
+  return outbox_length;
+}
+
+size_t outboxSize()
+{
+  return outbox_size;
+}
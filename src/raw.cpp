@@ -0,0 +1,83 @@
+#include "Arduino.h"
+#include "max.h"
+#include "raw.hpp"
+#include "replay.hpp"
+#include "mqtt.hpp"
+#include "main.hpp"
+
+bool raw_enabled = false;
+byte raw_batch_frames = RAW_BATCH_FRAMES;
+unsigned int raw_batch_interval = RAW_BATCH_INTERVAL;
+
+char raw_buffer[RAW_BUFFER_SIZE];
+unsigned int raw_length = 0;
+byte raw_batched = 0;
+unsigned long raw_batch_started_at = 0;
+
+unsigned long raw_frames = 0;
+unsigned long raw_dropped = 0;
+
+// Only appends, publishing is left to rawLoop() so the radio path never waits on the broker
+void rawFrame(const char *direction, const char *rssi, byte *data, byte length)
+{
+  if (!raw_enabled || replaying)
+  {
+    return;
+  }
+
+  raw_frames++;
+  if (raw_length + RAW_LINE_MAX > RAW_BUFFER_SIZE || length > MAX_MORITZ_MSG)
+  {
+    // rawLoop() didn't get to the full batch yet
+    raw_dropped++;
+    return;
+  }
+
+  if (raw_batched == 0)
+  {
+    raw_batch_started_at = millis();
+  }
+
+  raw_length += sprintf(raw_buffer + raw_length, "%lu %s %s ", millis(), direction, rssi);
+  bytesToString(raw_buffer + raw_length, data, length);
+  raw_length += length * 2;
+  raw_buffer[raw_length++] = '\n';
+  raw_buffer[raw_length] = '\0';
+  raw_batched++;
+}
+
+void rawReceived(CC1101Packet *packet, int rssi)
+{
+  // Without the RSSI and LQI status bytes appended by CC1101
+  char value[5];
+  snprintf(value, sizeof(value), "%i", rssi);
+  rawFrame("rx", value, packet->data, packet->length >= 2 ? packet->length - 2 : packet->length);
+}
+
+void rawSent(CC1101Packet *packet)
+{
+  rawFrame("tx", "-", packet->data, packet->length);
+}
+
+void rawLoop()
+{
+  if (raw_batched == 0)
+  {
+    return;
+  }
+
+  if (raw_batched < raw_batch_frames && raw_length + RAW_LINE_MAX <= RAW_BUFFER_SIZE && millis() - raw_batch_started_at < raw_batch_interval)
+  {
+    return;
+  }
+
+  // Not worth a place in the outbox, a batch the broker can't take is gone
+  if (!isMqttReady() || !client.beginPublish("max/raw", raw_length, false) ||
+      client.write((const byte *)raw_buffer, raw_length) != raw_length || !client.endPublish())
+  {
+    raw_dropped += raw_batched;
+  }
+
+  raw_length = 0;
+  raw_batched = 0;
+}
@@ -0,0 +1,385 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <vector>
+#include <queue>
+#include "max.h"
+#include "state.h"
+#include "message.h"
+#include "configuration.h"
+#include "capture.hpp"
+#include "device_index.hpp"
+#include "rooms.hpp"
+#include "stale_wheel.hpp"
+#include "time.hpp"
+#include "main.hpp"
+#include "replay.hpp"
+#include "mqtt.hpp"
+
+#ifdef CREDIT_15MIN
+extern unsigned long creditMs;
+#endif
+
+// The replay has its own device records, TX queue and counters, swapped in only while a batch of frames is handled.
+// Live frames, commands and heating control carry on between batches.
+bool replaying = false;      // Replay state is swapped in
+bool replay_running = false; // Between the first frame and endReplay()
+
+// Whichever side isn't swapped in
+std::vector<state> replay_states;
+std::queue<Message> replay_queue;
+byte replay_msg_counter;
+bool replay_config_changed;
+unsigned long replay_credit;
+
+unsigned long replay_clock;
+unsigned long replay_first_frame_at;
+unsigned long replay_credited_at;
+unsigned long replay_started_at;
+unsigned long replay_fed_at;
+
+unsigned long replay_frames;
+unsigned long replay_sent;
+unsigned long replay_handle_us;
+unsigned long replay_queue_us;
+unsigned long replay_heating_us;
+unsigned long replay_burner_switches;
+bool replay_burner_running;
+
+unsigned int replay_queue_max;
+byte replay_queue_depth[REPLAY_QUEUE_SAMPLES];
+byte replay_queue_samples;
+unsigned long replay_sample_interval;
+unsigned long replay_next_sample_at;
+
+// Saved records share day schedules with live ones, so they hold their own references
+void retainSchedules(state *device)
+{
+  for (byte weekDay = 0; weekDay < 7; weekDay++)
+  {
+    retainDaySchedule(device->schedule[weekDay]);
+  }
+}
+
+void releaseSchedules(state *device)
+{
+  for (byte weekDay = 0; weekDay < 7; weekDay++)
+  {
+    releaseDaySchedule(&device->schedule[weekDay]);
+  }
+}
+
+void swapReplayState()
+{
+  states.exchange(replay_states);
+  std::swap(queue, replay_queue);
+  std::swap(msgCounter, replay_msg_counter);
+  std::swap(config_changed, replay_config_changed);
+#ifdef CREDIT_15MIN
+  std::swap(creditMs, replay_credit);
+#endif
+
+  // Derived from the records, and room and stale deadlines are on the clock of their side
+  rebuildDeviceIndex();
+  rebuildRooms();
+  rebuildStaleWheel();
+  markHeatingDirty();
+}
+
+void enterReplay()
+{
+  replaying = true;
+  setVirtualClock(replay_clock);
+  swapReplayState();
+}
+
+void leaveReplay()
+{
+  resetVirtualClock();
+  replaying = false;
+  swapReplayState();
+}
+
+// Starts from a copy of the live records, with an empty TX queue
+void startReplay(unsigned long clock)
+{
+  Debug.println("Starting replay on a copy of the live state.");
+
+  states.save(replay_states);
+  for (int i = 0; i < replay_states.size(); i++)
+  {
+    retainSchedules(&replay_states[i]);
+  }
+  std::queue<Message>().swap(replay_queue);
+  replay_msg_counter = msgCounter;
+  replay_config_changed = false;
+#ifdef CREDIT_15MIN
+  replay_credit = creditMs;
+#endif
+  replay_running = true;
+
+  replay_clock = clock;
+  replay_first_frame_at = clock;
+  replay_credited_at = clock;
+  replay_started_at = millis();
+
+  replay_frames = 0;
+  replay_sent = 0;
+  replay_handle_us = 0;
+  replay_queue_us = 0;
+  replay_heating_us = 0;
+  replay_burner_switches = 0;
+  replay_burner_running = false;
+
+  replay_queue_max = 0;
+  replay_queue_samples = 0;
+  replay_sample_interval = REPLAY_SAMPLE_INTERVAL;
+  replay_next_sample_at = clock;
+}
+
+void sampleReplayQueue()
+{
+  while ((long)(replay_clock - replay_next_sample_at) >= 0)
+  {
+    if (replay_queue_samples == REPLAY_QUEUE_SAMPLES)
+    {
+      // Halve the resolution, keeping the peaks
+      for (byte i = 0; i < REPLAY_QUEUE_SAMPLES / 2; i++)
+      {
+        replay_queue_depth[i] = max(replay_queue_depth[i * 2], replay_queue_depth[i * 2 + 1]);
+      }
+      replay_queue_samples = REPLAY_QUEUE_SAMPLES / 2;
+      replay_sample_interval *= 2;
+      continue;
+    }
+
+    replay_queue_depth[replay_queue_samples++] = min(queue.size(), (size_t)255);
+    replay_next_sample_at += replay_sample_interval;
+  }
+}
+
+void replaySent(CC1101Packet *packet, bool longPreamble)
+{
+  replay_sent++;
+  replay_clock += packet->length * 8 + REPLAY_SEND_GAP;
+  if (longPreamble)
+  {
+    replay_clock += 1000;
+  }
+}
+
+void runReplayQueueUntil(unsigned long until)
+{
+  while (!queue.empty() && (long)(until - replay_clock) > 0)
+  {
+#ifdef CREDIT_15MIN
+    if (replay_clock - replay_credited_at > 15 * 60 * 1000)
+    {
+      creditMs = CREDIT_15MIN;
+      replay_credited_at = replay_clock;
+    }
+#endif
+
+    const unsigned long clock = replay_clock;
+    setVirtualClock(replay_clock);
+
+    unsigned long start = micros();
+    sendMessageFromQueue();
+    replay_queue_us += micros() - start;
+
+    if (replay_clock == clock)
+    {
+      // Out of credit, the rest waits for next frame
+      break;
+    }
+
+    sampleReplayQueue();
+  }
+}
+
+void replayFrame(unsigned long timestamp, int rssi, byte lqi, const byte *frame, byte length)
+{
+  runReplayQueueUntil(timestamp);
+
+  // Frames received while we were transmitting get handled late
+  if ((long)(timestamp - replay_clock) > 0)
+  {
+    replay_clock = timestamp;
+  }
+  sampleReplayQueue();
+  setVirtualClock(replay_clock);
+
+  // Rebuild RSSI and LQI status bytes as appended by CC1101
+  CC1101Packet packet;
+  memcpy(packet.data, frame, length);
+  packet.data[length] = (byte)((rssi + 74) * 2);
+  packet.data[length + 1] = lqi;
+  packet.length = length + 2;
+
+  unsigned long start = micros();
+  handle(&packet);
+  replay_handle_us += micros() - start;
+
+  start = micros();
+  staleLoop();
+  syncValvesToWallThermostats();
+  const int heating_needed = heatingDemand();
+  replay_heating_us += micros() - start;
+
+  if ((heating_needed == 1 && !replay_burner_running) || (heating_needed == -1 && replay_burner_running))
+  {
+    replay_burner_running = !replay_burner_running;
+    replay_burner_switches++;
+  }
+
+  replay_frames++;
+  replay_queue_max = max(replay_queue_max, (unsigned int)queue.size());
+}
+
+void replay(byte *payload, unsigned int length)
+{
+  replay_fed_at = millis();
+
+  // Same record layout as capture, see capture.hpp
+  unsigned int position = 0;
+  while (position + CAPTURE_HEADER_LENGTH < length)
+  {
+    if (payload[position] != CAPTURE_MAGIC)
+    {
+      position++;
+      continue;
+    }
+
+    byte *record = payload + position;
+    const byte flags = record[1];
+    uint32_t timestamp;
+    memcpy(&timestamp, record + 2, 4);
+    const int rssi = (int8_t)record[6];
+    const byte lqi = record[7];
+    const byte frameLength = record[8];
+    const unsigned int recordLength = CAPTURE_HEADER_LENGTH + frameLength + 1;
+
+    byte checksum = 0;
+    for (unsigned int i = 0; i < recordLength - 1 && position + i < length; i++)
+    {
+      checksum += record[i];
+    }
+
+    if (position + recordLength > length || checksum != record[recordLength - 1] || frameLength + 2 > sizeof(CC1101Packet::data))
+    {
+      position++;
+      continue;
+    }
+    position += recordLength;
+
+    // Only received frames are replayed, our own transmissions are regenerated
+    if (flags & (CAPTURE_TX | CAPTURE_CLOCK))
+    {
+      continue;
+    }
+
+    if (!replay_running)
+    {
+      startReplay(timestamp);
+    }
+    if (!replaying)
+    {
+      enterReplay();
+    }
+
+    replayFrame(timestamp, rssi, lqi, record + CAPTURE_HEADER_LENGTH, frameLength);
+    yield();
+  }
+
+  if (replaying)
+  {
+    leaveReplay();
+  }
+}
+
+void publishReplayReport()
+{
+  DynamicJsonDocument doc(JSON_OBJECT_SIZE(16) + JSON_ARRAY_SIZE(REPLAY_QUEUE_SAMPLES) + states.size() * JSON_OBJECT_SIZE(6) + 256);
+
+  const unsigned long cpu_us = replay_handle_us + replay_queue_us + replay_heating_us;
+  doc["frames"] = replay_frames;
+  doc["sent"] = replay_sent;
+  doc["virtual_s"] = (replay_clock - replay_first_frame_at) / 1000;
+  doc["wall_ms"] = millis() - replay_started_at;
+  doc["fps"] = cpu_us ? replay_frames * 1000000.0 / cpu_us : 0;
+  doc["burner_switches"] = replay_burner_switches;
+
+  JsonObject cpu = doc.createNestedObject("cpu_us");
+  cpu["handle"] = replay_handle_us;
+  cpu["queue"] = replay_queue_us;
+  cpu["heating"] = replay_heating_us;
+
+  JsonObject queueDepth = doc.createNestedObject("queue");
+  queueDepth["max"] = replay_queue_max;
+  queueDepth["interval_s"] = replay_sample_interval / 1000;
+  JsonArray depth = queueDepth.createNestedArray("depth");
+  for (byte i = 0; i < replay_queue_samples; i++)
+  {
+    depth.add(replay_queue_depth[i]);
+  }
+
+  JsonObject devices = doc.createNestedObject("devices");
+  state *device;
+  for (int i = 0; i < states.size(); i++)
+  {
+    device = &states[i];
+    JsonObject entry = devices.createNestedObject(pooledString(device->name));
+    entry["type"] = typeToString(device->type);
+    if (device->mode != UNDEFINED)
+    {
+      entry["mode"] = modeToString(device->mode);
+    }
+    if (device->measured_temperature != UNDEFINED)
+    {
+      entry["measured_temperature"] = TENTHS_TO_JSON(device->measured_temperature);
+    }
+    if (device->desired_temperature != UNDEFINED)
+    {
+      entry["desired_temperature"] = TENTHS_TO_JSON(HALVES_TO_TENTHS(device->desired_temperature));
+    }
+    if (device->valve_position != UNDEFINED)
+    {
+      entry["valve_position"] = device->valve_position;
+    }
+  }
+
+  // Report is larger than PubSubClient's buffer, publishJson() streams it
+  publishJson("max/replay/report", doc, false);
+
+  Debug.printf("Replayed %lu frames in %lu us\n", replay_frames, cpu_us);
+}
+
+void endReplay()
+{
+  if (!replay_running)
+  {
+    return;
+  }
+
+  enterReplay();
+  runReplayQueueUntil(replay_clock + REPLAY_DRAIN_LIMIT);
+  publishReplayReport();
+  for (int i = 0; i < states.size(); i++)
+  {
+    releaseSchedules(&states[i]);
+  }
+  leaveReplay();
+
+  std::vector<state>().swap(replay_states);
+  std::queue<Message>().swap(replay_queue);
+  replay_running = false;
+  Debug.println("Replay finished.");
+}
+
+void replayLoop()
+{
+  if (replay_running && millis() - replay_fed_at > REPLAY_TIMEOUT)
+  {
+    Debug.println("Replay feeder went away.");
+    endReplay();
+  }
+}
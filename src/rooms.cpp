@@ -0,0 +1,129 @@
+#include "Arduino.h"
+#include <vector>
+#include "max.h"
+#include "state.h"
+#include "time.hpp"
+#include "rooms.hpp"
+#include "stale_wheel.hpp"
+#include "main.hpp"
+
+std::vector<room> rooms;
+
+short findOrAddRoom(string_id name)
+{
+  for (short i = 0; i < rooms.size(); i++)
+  {
+    if (rooms[i].name == name)
+    {
+      return i;
+    }
+  }
+
+  rooms.push_back(room());
+  rooms.back().name = name;
+  return rooms.size() - 1;
+}
+
+// Membership only changes on room or type changes, config load and replay, so start over then
+void rebuildRooms()
+{
+  rooms.clear();
+  markHeatingDirty();
+
+  state *device;
+  for (uint16_t i = 0; i < states.size(); i++)
+  {
+    device = &states[i];
+    device->room_id = UNDEFINED;
+
+    if (device->type == DEVICE_WALL_THERMOSTAT)
+    {
+      // Derived from the room's valves, nothing left to derive it from
+      device->valve_position = UNDEFINED;
+    }
+
+    if (device->room == STRING_NONE || (device->type != DEVICE_WALL_THERMOSTAT && device->type != DEVICE_HEATING_THERMOSTAT))
+    {
+      continue;
+    }
+
+    device->room_id = findOrAddRoom(device->room);
+    room *entry = &rooms[device->room_id];
+    if (device->type == DEVICE_HEATING_THERMOSTAT)
+    {
+      entry->valves.push_back(i);
+    }
+    else if (entry->wall_thermostat == ROOM_NO_THERMOSTAT)
+    {
+      entry->wall_thermostat = i;
+    }
+  }
+}
+
+void markRoomDirty(state *device)
+{
+  if (device->room_id != UNDEFINED && device->room_id < rooms.size())
+  {
+    rooms[device->room_id].dirty = true;
+  }
+}
+
+state *findWallThermostatOf(state *device)
+{
+  if (device->room_id == UNDEFINED || device->room_id >= rooms.size())
+  {
+    return 0;
+  }
+
+  const uint16_t position = rooms[device->room_id].wall_thermostat;
+  if (position == ROOM_NO_THERMOSTAT)
+  {
+    return 0;
+  }
+
+  return &states[position];
+}
+
+void syncRoom(room *entry)
+{
+  state *thermostat = &states[entry->wall_thermostat];
+  thermostat->valve_position = UNDEFINED;
+
+  state *device;
+  for (uint16_t i = 0; i < entry->valves.size(); i++)
+  {
+    device = &states[entry->valves[i]];
+    if (!(device->fresh & FRESH_VALVE))
+    {
+      continue;
+    }
+
+    if (device->valve_position > thermostat->valve_position)
+    {
+      thermostat->valve_position = device->valve_position;
+      thermostat->valve_timestamp = device->valve_timestamp;
+    }
+  }
+
+  entry->dirty = false;
+  markHeatingDirty();
+}
+
+// Valves going stale mark their room dirty from the stale wheel
+void syncValvesToWallThermostats()
+{
+  room *entry;
+  for (uint16_t i = 0; i < rooms.size(); i++)
+  {
+    entry = &rooms[i];
+    if (entry->wall_thermostat == ROOM_NO_THERMOSTAT)
+    {
+      continue;
+    }
+
+    if (entry->dirty)
+    {
+      syncRoom(entry);
+    }
+  }
+}
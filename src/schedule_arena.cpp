@@ -0,0 +1,139 @@
+#include "Arduino.h"
+#include "schedule_arena.hpp"
+#include "main.hpp"
+
+schedule_slot *schedule_slots = 0;
+byte schedule_capacity = 0;
+
+// Once, before device configs are loaded, so it never fragments the heap. Later calls keep the first size.
+void setupScheduleArena(size_t devices)
+{
+  if (schedule_slots)
+  {
+    return;
+  }
+
+  const size_t capacity = min((devices + SCHEDULE_SPARE_DEVICES) * SCHEDULE_DEVICE_SLOTS, (size_t)SCHEDULE_SLOTS_MAX);
+  schedule_slots = (schedule_slot *)calloc(capacity, sizeof(schedule_slot));
+  schedule_capacity = schedule_slots ? capacity : 0;
+  Debug.printf("Schedule arena of %u days for %u devices\n", schedule_capacity, (unsigned)devices);
+}
+
+schedule_slot *scheduleSlot(schedule_id id)
+{
+  if (id == SCHEDULE_NONE || id > schedule_capacity)
+  {
+    return 0;
+  }
+
+  return &schedule_slots[id - 1];
+}
+
+void retainDaySchedule(schedule_id id)
+{
+  schedule_slot *slot = scheduleSlot(id);
+  if (slot)
+  {
+    slot->refs++;
+  }
+}
+
+void releaseDaySchedule(schedule_id *id)
+{
+  schedule_slot *slot = scheduleSlot(*id);
+  if (slot && slot->refs > 0)
+  {
+    slot->refs--;
+  }
+  *id = SCHEDULE_NONE;
+}
+
+// Updates the day in place when only this device uses it, otherwise shares an identical
+// day or takes a free slot. Returns false when the arena is full.
+bool storeDaySchedule(schedule_id *id, const byte *data, byte size)
+{
+  size = min(size, (byte)DAY_SCHEDULE_LENGTH);
+  if (size == 0)
+  {
+    releaseDaySchedule(id);
+    return true;
+  }
+
+  schedule_slot *current = scheduleSlot(*id);
+  if (current && current->size == size && memcmp(current->data, data, size) == 0)
+  {
+    return true;
+  }
+
+  if (current && current->refs == 1)
+  {
+    current->size = size;
+    memcpy(current->data, data, size);
+    return true;
+  }
+
+  schedule_id free_id = SCHEDULE_NONE;
+  for (uint16_t i = 1; i <= schedule_capacity; i++)
+  {
+    schedule_slot *slot = &schedule_slots[i - 1];
+    if (slot->refs == 0)
+    {
+      if (free_id == SCHEDULE_NONE)
+      {
+        free_id = i;
+      }
+    }
+    else if (slot->size == size && memcmp(slot->data, data, size) == 0)
+    {
+      releaseDaySchedule(id);
+      slot->refs++;
+      *id = i;
+      return true;
+    }
+  }
+
+  if (free_id == SCHEDULE_NONE)
+  {
+    Debug.println("Schedule arena is full");
+    return false;
+  }
+
+  releaseDaySchedule(id);
+  schedule_slot *slot = &schedule_slots[free_id - 1];
+  slot->refs = 1;
+  slot->size = size;
+  memcpy(slot->data, data, size);
+  *id = free_id;
+  return true;
+}
+
+const byte *daySchedule(schedule_id id)
+{
+  schedule_slot *slot = scheduleSlot(id);
+  return slot ? slot->data : 0;
+}
+
+byte dayScheduleSize(schedule_id id)
+{
+  schedule_slot *slot = scheduleSlot(id);
+  return slot ? slot->size : 0;
+}
+
+byte scheduleSlotsUsed()
+{
+  byte used = 0;
+  for (uint16_t i = 0; i < schedule_capacity; i++)
+  {
+    if (schedule_slots[i].refs > 0)
+    {
+      used++;
+    }
+  }
+
+  return used;
+}
+
+byte scheduleCapacity()
+{
+  return schedule_capacity;
+}
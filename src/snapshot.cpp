@@ -0,0 +1,118 @@
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "state.h"
+#include "device_pool.hpp"
+#include "string_pool.hpp"
+#include "outbox.hpp"
+#include "stale_wheel.hpp"
+#include "mqtt.hpp"
+#include "snapshot.hpp"
+#include "replay.hpp"
+#include "main.hpp"
+
+bool snapshot_enabled = false;
+bool snapshot_dirty = true;
+bool snapshot_settled = false;
+unsigned long snapshot_published_at = 0;
+
+// Called whenever a device's own state went out, so the snapshot follows the same change tracking
+void markSnapshotDirty()
+{
+  snapshot_dirty = true;
+}
+
+bool isInSnapshot(state *device)
+{
+  return device->name != STRING_NONE;
+}
+
+// A retained snapshot of the few devices heard right after boot would look like the whole house to consumers
+bool isSnapshotSettled()
+{
+  if (snapshot_settled || millis() >= SNAPSHOT_SETTLE)
+  {
+    return snapshot_settled = true;
+  }
+
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    if (isInSnapshot(&states[handle]) && !(states[handle].fresh & FRESH_SEEN))
+    {
+      return false;
+    }
+  }
+
+  return snapshot_settled = true;
+}
+
+// {"devices":{"<name>":{<same as max/<name>>},...}}
+void publishSnapshot()
+{
+  StaticJsonDocument<JSON_OBJECT_SIZE(12) + 256> doc;
+  StaticJsonDocument<16> key;
+
+  // Streamed device by device, so the whole house never sits in RAM. Measured first, MQTT needs the length upfront.
+  size_t length = strlen("{\"devices\":{}}");
+  bool first = true;
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    state *device = &states[handle];
+    if (!isInSnapshot(device))
+    {
+      continue;
+    }
+
+    doc.clear();
+    buildStateDocument(device, doc);
+    key.set(pooledString(device->name));
+    length += measureJson(key) + 1 + measureJson(doc) + (first ? 0 : 1);
+    first = false;
+  }
+
+  if (!beginStream("max/snapshot", length, true))
+  {
+    return;
+  }
+
+  streamText("{\"devices\":{");
+  first = true;
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    state *device = &states[handle];
+    if (!isInSnapshot(device))
+    {
+      continue;
+    }
+
+    if (!first)
+    {
+      streamText(",");
+    }
+    first = false;
+
+    doc.clear();
+    buildStateDocument(device, doc);
+    key.set(pooledString(device->name));
+    streamJson(key);
+    streamText(":");
+    streamJson(doc);
+    yield();
+  }
+  streamText("}}");
+
+  if (endStream())
+  {
+    snapshot_dirty = false;
+  }
+}
+
+void snapshotLoop()
+{
+  if (!snapshot_enabled || !snapshot_dirty || replaying || !isMqttReady() || !isOutboxEmpty() || millis() - snapshot_published_at < SNAPSHOT_INTERVAL || !isSnapshotSettled())
+  {
+    return;
+  }
+
+  snapshot_published_at = millis();
+  publishSnapshot();
+}
@@ -0,0 +1,190 @@
+#include "Arduino.h"
+#include "max.h"
+#include "state.h"
+#include "time.hpp"
+#include "device_pool.hpp"
+#include "rooms.hpp"
+#include "replay.hpp"
+#include "stale_wheel.hpp"
+#include "mqtt.hpp"
+#include "main.hpp"
+
+// Devices queued by the tick they may go stale on, linked through state.stale_next
+uint16_t stale_wheel[STALE_WHEEL_SLOTS];
+tick_t stale_wheel_tick = 0; // Next tick to expire
+
+byte freshFields(state *device)
+{
+  byte fields = 0;
+  if (isFresh(device->timestamp))
+  {
+    fields |= FRESH_SEEN;
+  }
+  if (isFresh(device->valve_timestamp))
+  {
+    fields |= FRESH_VALVE;
+  }
+  if (isFresh(device->desired_temperature_timestamp))
+  {
+    fields |= FRESH_DESIRED;
+  }
+  if (isFresh(device->measured_temperature_timestamp))
+  {
+    fields |= FRESH_MEASURED;
+  }
+
+  return fields;
+}
+
+// First tick one of the fresh fields goes stale on
+tick_t staleAt(state *device)
+{
+  tick_t age = 0;
+  if (device->fresh & FRESH_SEEN)
+  {
+    age = max(age, ticksSince(device->timestamp));
+  }
+  if (device->fresh & FRESH_VALVE)
+  {
+    age = max(age, ticksSince(device->valve_timestamp));
+  }
+  if (device->fresh & FRESH_DESIRED)
+  {
+    age = max(age, ticksSince(device->desired_temperature_timestamp));
+  }
+  if (device->fresh & FRESH_MEASURED)
+  {
+    age = max(age, ticksSince(device->measured_temperature_timestamp));
+  }
+
+  return nowTicks() - age + STALE_TICKS + 1;
+}
+
+void armDevice(device_handle handle)
+{
+  state *device = &states[handle];
+  if ((device->fresh & FRESH_ARMED) || !(device->fresh & FRESH_FIELDS))
+  {
+    return;
+  }
+
+  // Wheel may lag behind a jump of the replay clock, firing early is fine, see refreshDevice()
+  tick_t at = staleAt(device);
+  if ((tick_t)(at - stale_wheel_tick) >= 0x8000)
+  {
+    at = stale_wheel_tick;
+  }
+
+  const byte slot = at & (STALE_WHEEL_SLOTS - 1);
+  device->stale_next = stale_wheel[slot];
+  stale_wheel[slot] = handle;
+  device->fresh |= FRESH_ARMED;
+}
+
+// Called after a frame updated the device's timestamps and when its deadline passes
+void refreshDevice(device_handle handle)
+{
+  state *device = &states[handle];
+  const byte fields = freshFields(device);
+  const byte gained = fields & ~device->fresh;
+  const byte lost = device->fresh & FRESH_FIELDS & ~fields;
+  device->fresh = (device->fresh & FRESH_ARMED) | fields;
+
+  if (lost & FRESH_VALVE)
+  {
+    markRoomDirty(device);
+  }
+  if (lost)
+  {
+    markHeatingDirty();
+  }
+  if ((gained | lost) & FRESH_SEEN)
+  {
+    publishAvailability(device);
+  }
+
+  armDevice(handle);
+}
+
+void expireSlot(byte slot)
+{
+  uint16_t handle = stale_wheel[slot];
+  stale_wheel[slot] = STALE_NONE;
+
+  while (handle != STALE_NONE)
+  {
+    state *device = &states[handle];
+    const uint16_t next = device->stale_next;
+    device->stale_next = STALE_NONE;
+    device->fresh &= ~FRESH_ARMED;
+    refreshDevice(handle);
+    handle = next;
+  }
+}
+
+// Device records were replaced or the clock jumped, queue every fresh device again
+void rebuildStaleWheel()
+{
+  for (byte slot = 0; slot < STALE_WHEEL_SLOTS; slot++)
+  {
+    stale_wheel[slot] = STALE_NONE;
+  }
+  stale_wheel_tick = nowTicks() + 1;
+
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    states[handle].fresh &= ~FRESH_ARMED;
+    states[handle].stale_next = STALE_NONE;
+    armDevice(handle);
+  }
+}
+
+void staleLoop()
+{
+  const tick_t now = nowTicks();
+  tick_t due = now - stale_wheel_tick + 1;
+  if (due >= 0x8000)
+  {
+    return;
+  }
+
+  if (due > STALE_WHEEL_SLOTS)
+  {
+    due = STALE_WHEEL_SLOTS;
+  }
+
+  for (tick_t i = 0; i < due; i++)
+  {
+    expireSlot((stale_wheel_tick + i) & (STALE_WHEEL_SLOTS - 1));
+  }
+  stale_wheel_tick = now + 1;
+}
+
+// Retained, devices not heard from since boot are offline. now skips the outbox, for the announcement after connecting.
+void publishAvailability(state *device, bool now)
+{
+  if (replaying || device->name == STRING_NONE)
+  {
+    return;
+  }
+
+  char topic[MQTT_TOPIC_MAX];
+  deviceTopic(topic, device, "/availability");
+  const char *payload = device->fresh & FRESH_SEEN ? "{\"availability\":\"online\"}" : "{\"availability\":\"offline\"}";
+  if (now)
+  {
+    publishTextNow(topic, payload, true);
+  }
+  else
+  {
+    publishText(topic, payload, true);
+  }
+}
+
+void publishAvailabilities(bool now)
+{
+  for (device_handle handle = 0; handle < states.size(); handle++)
+  {
+    publishAvailability(&states[handle], now);
+  }
+}
@@ -0,0 +1,139 @@
+#include "Arduino.h"
+#include <vector>
+#include "state.h"
+#include "string_pool.hpp"
+#include "replay.hpp"
+#include "main.hpp"
+
+#define STRING_FREE 0xFFFF
+
+// NUL terminated strings, offsets indexed by id - 1
+std::vector<char> string_pool;
+std::vector<uint16_t> string_offsets;
+
+string_id internString(const char *value)
+{
+  if (!value || !value[0])
+  {
+    return STRING_NONE;
+  }
+
+  // Rooms are shared between devices, so look for an existing copy first
+  string_id free_id = STRING_NONE;
+  for (uint16_t i = 0; i < string_offsets.size(); i++)
+  {
+    if (string_offsets[i] == STRING_FREE)
+    {
+      if (free_id == STRING_NONE)
+      {
+        free_id = i + 1;
+      }
+      continue;
+    }
+
+    if (strcmp(string_pool.data() + string_offsets[i], value) == 0)
+    {
+      return i + 1;
+    }
+  }
+
+  if (free_id == STRING_NONE)
+  {
+    if (string_offsets.size() == STRING_POOL_SLOTS)
+    {
+      collectStrings();
+      if (stringPoolCount() == STRING_POOL_SLOTS)
+      {
+        Debug.printf("String pool is full, dropping %s\n", value);
+        return STRING_NONE;
+      }
+      return internString(value);
+    }
+
+    string_offsets.push_back(STRING_FREE);
+    free_id = string_offsets.size();
+  }
+
+  string_offsets[free_id - 1] = string_pool.size();
+  string_pool.insert(string_pool.end(), value, value + strlen(value) + 1);
+
+  return free_id;
+}
+
+const char *pooledString(string_id id)
+{
+  if (id == STRING_NONE || id > string_offsets.size() || string_offsets[id - 1] == STRING_FREE)
+  {
+    return "";
+  }
+
+  return string_pool.data() + string_offsets[id - 1];
+}
+
+void markString(std::vector<bool> &used, string_id id)
+{
+  if (id != STRING_NONE && id <= used.size())
+  {
+    used[id - 1] = true;
+  }
+}
+
+// Drops strings no device refers to anymore, e.g. after a rename. Ids stay stable.
+void collectStrings()
+{
+  // The replay's records are kept aside between batches and still refer to the pool
+  if (replay_running)
+  {
+    return;
+  }
+
+  std::vector<bool> used(string_offsets.size(), false);
+  for (int i = 0; i < states.size(); i++)
+  {
+    markString(used, states[i].name);
+    markString(used, states[i].topic);
+    markString(used, states[i].room);
+  }
+
+  std::vector<char> compacted;
+  compacted.reserve(string_pool.size());
+  for (uint16_t i = 0; i < string_offsets.size(); i++)
+  {
+    if (!used[i] || string_offsets[i] == STRING_FREE)
+    {
+      string_offsets[i] = STRING_FREE;
+      continue;
+    }
+
+    const char *value = string_pool.data() + string_offsets[i];
+    string_offsets[i] = compacted.size();
+    compacted.insert(compacted.end(), value, value + strlen(value) + 1);
+  }
+
+  while (!string_offsets.empty() && string_offsets.back() == STRING_FREE)
+  {
+    string_offsets.pop_back();
+  }
+
+  compacted.shrink_to_fit();
+  string_pool.swap(compacted);
+}
+
+size_t stringPoolBytes()
+{
+  return string_pool.capacity() + string_offsets.capacity() * sizeof(uint16_t);
+}
+
+byte stringPoolCount()
+{
+  byte count = 0;
+  for (uint16_t i = 0; i < string_offsets.size(); i++)
+  {
+    if (string_offsets[i] != STRING_FREE)
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
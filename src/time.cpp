@@ -1,23 +1,75 @@
 #include "Arduino.h"
-#include <WiFiUdp.h>
-#include <NTP.h>
+#include <time.h>
 #include <time.hpp>
+#include "main.hpp"
 
-WiFiUDP wifiUdp;
-NTP ntp(wifiUdp);
+unsigned long virtual_clock_offset = 0;
 
+// The SDK's SNTP client sends and receives from the network stack on its own, nothing in loop() waits for the server
 void setupTime() {
-  // Central European Time
-  ntp.ruleDST("CEST", Last, Sun, Mar, 2, 120); // last sunday in march 2:00, timetone +120min (+1 GMT + 1h summertime offset)
-  ntp.ruleSTD("CET", Last, Sun, Oct, 3, 60); // last sunday in october 3:00, timezone +60min (+1 GMT)
-
-  ntp.begin(false);
+  configTime(TIME_ZONE, NTP_SERVER);
 }
 
 void printTime() {
-  Serial.println(ntp.formattedTime("%Y-%m-%d %H:%M:%S"));
+  Debug.println(formatTime("%Y-%m-%d %H:%M:%S"));
 }
 
 bool isTimeSynced() {
-  return ntp.epoch() > TENYEARS;
-}
\ No newline at end of file
+  return nowEpoch() > TENYEARS;
+}
+
+uint32_t nowEpoch() {
+  return time(nullptr);
+}
+
+struct tm localTime() {
+  const time_t now = time(nullptr);
+  struct tm local;
+  localtime_r(&now, &local);
+  return local;
+}
+
+// Until the next call
+const char *formatTime(const char *format) {
+  static char formatted[32];
+  const struct tm local = localTime();
+  strftime(formatted, sizeof(formatted), format, &local);
+  return formatted;
+}
+
+unsigned long virtualMillis() {
+  return millis() + virtual_clock_offset;
+}
+
+void setVirtualClock(unsigned long ms) {
+  virtual_clock_offset = ms - millis();
+}
+
+void resetVirtualClock() {
+  virtual_clock_offset = 0;
+}
+
+tick_t nowTicks() {
+  return virtualMillis() >> TICK_SHIFT;
+}
+
+tick_t ticksSince(tick_t stamp) {
+  return nowTicks() - stamp;
+}
+
+// 0 when the tick has started already
+unsigned long millisUntilTick(tick_t tick) {
+  const tick_t ahead = tick - nowTicks();
+  if (ahead == 0 || ahead >= 0x8000) {
+    return 0;
+  }
+
+  return ((unsigned long)ahead << TICK_SHIFT) - (virtualMillis() & TICK_MASK);
+}
+
+// Run on every stamp each TICK_AGE_INTERVAL, so no age gets near half the range, where it would wrap and look recent
+void ageTick(tick_t &stamp) {
+  if (ticksSince(stamp) > TICK_AGE_MAX) {
+    stamp = nowTicks() - TICK_AGE_MAX;
+  }
+}
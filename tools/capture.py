@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""Reader for max2mqtt radio captures.
+
+Accepts the flash ring dump (max/capture/flash), concatenated MQTT batches
+(max/capture) or a raw serial stream, e.g.:
+
+    mosquitto_sub -h mqtt.lan -t max/capture -N >> capture.bin
+    ./tools/capture.py capture.bin
+"""
+
+import argparse
+import datetime
+import struct
+import sys
+
+MAGIC = 0xC5
+HEADER_LENGTH = 9
+FLASH_MAGIC = b"MAXC"
+FLASH_HEADER_LENGTH = 8
+
+TX = 0x80
+CLOCK = 0x40
+LONG_PREAMBLE = 0x20
+RESULT_MASK = 0x07
+
+RESULTS = {
+    0x00: "decoded",
+    0x01: "bad-length",
+    0x02: "ignored",
+    0x03: "unknown-command",
+}
+
+
+class Record:
+    def __init__(self, flags, millis, rssi, lqi, frame):
+        self.flags = flags
+        self.millis = millis
+        self.rssi = rssi
+        self.lqi = lqi
+        self.frame = frame
+        self.time = None
+
+    @property
+    def is_tx(self):
+        return bool(self.flags & TX)
+
+    @property
+    def is_clock(self):
+        return bool(self.flags & CLOCK)
+
+    @property
+    def long_preamble(self):
+        return bool(self.flags & LONG_PREAMBLE)
+
+    @property
+    def result(self):
+        return RESULTS.get(self.flags & RESULT_MASK, "unknown")
+
+    def airtime_ms(self):
+        # 1kbit/s, one second of preamble for sleeping devices
+        return len(self.frame) * 8 + (1000 if self.long_preamble else 0)
+
+
+def linearize(data):
+    """Unwrap the flash ring so records come out oldest first."""
+    if not data.startswith(FLASH_MAGIC) or len(data) < FLASH_HEADER_LENGTH:
+        return data
+
+    (offset,) = struct.unpack_from("<I", data, 4)
+    ring = data[FLASH_HEADER_LENGTH:]
+    return ring[offset:] + ring[:offset]
+
+
+def parse(data):
+    """Yield records from a byte stream, resyncing on garbage."""
+    position = 0
+    while position + HEADER_LENGTH < len(data):
+        if data[position] != MAGIC:
+            position += 1
+            continue
+
+        flags, millis, rssi, lqi, length = struct.unpack_from("<BIbBB", data, position + 1)
+        end = position + HEADER_LENGTH + length
+        if end >= len(data) or sum(data[position:end]) & 0xFF != data[end]:
+            position += 1
+            continue
+
+        yield Record(flags, millis, rssi, lqi, bytes(data[position + HEADER_LENGTH:end]))
+        position = end + 1
+
+
+def read(paths):
+    """Read records from files, assigning wall clock time from clock records."""
+    records = []
+    for path in paths:
+        if path == "-":
+            data = sys.stdin.buffer.read()
+        else:
+            with open(path, "rb") as file:
+                data = file.read()
+        records.extend(parse(linearize(data)))
+
+    clock = None
+    for record in records:
+        if record.is_clock:
+            (epoch,) = struct.unpack("<I", record.frame[:4])
+            clock = (epoch, record.millis)
+            continue
+
+        if clock and record.millis >= clock[1]:
+            record.time = clock[0] + (record.millis - clock[1]) / 1000.0
+
+    return [record for record in records if not record.is_clock]
+
+
+def format_time(record):
+    if record.time is None:
+        return "%12.3f" % (record.millis / 1000.0)
+    return datetime.datetime.fromtimestamp(record.time, datetime.timezone.utc).strftime("%Y-%m-%d %H:%M:%S.%f")[:-3]
+
+
+def print_records(records):
+    for record in records:
+        if record.is_tx:
+            direction = "TX" + ("*" if record.long_preamble else " ")
+            details = ""
+        else:
+            direction = "RX "
+            details = " rssi=%i lqi=%i %s" % (record.rssi, record.lqi & 0x7F, record.result)
+        print("%s %s %s%s" % (format_time(record), direction, record.frame.hex().upper(), details))
+
+
+def print_stats(records):
+    rx = [record for record in records if not record.is_tx]
+    tx = [record for record in records if record.is_tx]
+    print("Frames: %i received, %i sent" % (len(rx), len(tx)))
+    for code, name in sorted(RESULTS.items()):
+        print("  %-16s %i" % (name, len([record for record in rx if record.flags & RESULT_MASK == code])))
+    print("Airtime sent: %.1f s, %i with long preamble" % (
+        sum(record.airtime_ms() for record in tx) / 1000.0,
+        len([record for record in tx if record.long_preamble])))
+    if records:
+        span = (records[-1].millis - records[0].millis) / 1000.0
+        print("Span: %.0f s" % span)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("paths", nargs="+", metavar="FILE", help="capture file, - for stdin")
+    parser.add_argument("--stats", action="store_true", help="print summary instead of frames")
+    args = parser.parse_args()
+
+    records = read(args.paths)
+    if args.stats:
+        print_stats(records)
+    else:
+        print_records(records)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,76 @@
+// Device lookup by address, the old linear scan over states against findDevicePositionByAddress(), on the host.
+//
+//     make -C tools device_index_benchmark
+//     tools/device_index_benchmark
+//
+// Registries of 10, 100 and 1000 devices in the real DevicePool, beyond what the bridge's heap holds, to show how
+// each scales. Times are the host's.
+
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "state.h"
+#include "device_pool.hpp"
+#include "device_index.hpp"
+
+#define ROUNDS 1000000
+
+// findDeviceByAddress() before the index
+int findByScan(const byte *address)
+{
+  for (device_handle position = 0; position < states.size(); position++)
+  {
+    if (memcmp(states[position].address, address, 3) == 0)
+    {
+      return position;
+    }
+  }
+
+  return -1;
+}
+
+template <typename Find>
+double nanosPerLookup(Find find, const std::vector<uint32_t> &keys)
+{
+  volatile long sink = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < ROUNDS; i++)
+  {
+    const uint32_t key = keys[i % keys.size()];
+    const byte address[3] = {(byte)(key >> 16), (byte)(key >> 8), (byte)key};
+    sink += find(address);
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ROUNDS;
+}
+
+int main()
+{
+  const size_t sizes[] = {10, 100, 1000};
+  for (size_t size : sizes)
+  {
+    // Same made up addresses as replay.py --synthetic, looked up in a shuffled order, one in eight unknown
+    while (states.size() < size)
+    {
+      const uint32_t key = 0xA00000 + states.size();
+      state &device = states[states.add()];
+      device.address[0] = key >> 16;
+      device.address[1] = key >> 8;
+      device.address[2] = key;
+    }
+    rebuildDeviceIndex();
+
+    std::vector<uint32_t> keys;
+    for (size_t i = 0; i < size; i++)
+    {
+      keys.push_back((i * 7919) % size + 0xA00000 + (i % 8 == 7 ? size : 0));
+    }
+
+    printf("%5u devices  scan %8.1f ns  index %6.1f ns\n", (unsigned)size, nanosPerLookup(findByScan, keys),
+           nanosPerLookup(findDevicePositionByAddress, keys));
+  }
+
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include <chrono>
+#include <thread>
+#include "Arduino.h"
+#include "SPI.h"
+
+HardwareSerial Serial;
+EspClass ESP;
+SPIClass SPI;
+
+static const auto started_at = std::chrono::steady_clock::now();
+
+unsigned long millis()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started_at).count();
+}
+
+unsigned long micros()
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started_at).count();
+}
+
+void delay(unsigned long ms)
+{
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void yield()
+{
+}
+
+long random(long howBig)
+{
+  return howBig > 0 ? rand() % howBig : 0;
+}
+
+long random(long howSmall, long howBig)
+{
+  return howSmall < howBig ? howSmall + random(howBig - howSmall) : howSmall;
+}
+
+void randomSeed(unsigned long seed)
+{
+  srand(seed);
+}
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *destination, const char *source, size_t size)
+{
+  const size_t length = strlen(source);
+  if (size)
+  {
+    const size_t copied = length < size - 1 ? length : size - 1;
+    memcpy(destination, source, copied);
+    destination[copied] = 0;
+  }
+  return length;
+}
+#endif
+
+String::String(double number, unsigned char decimals)
+{
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%.*f", decimals, number);
+  value = buffer;
+}
+
+std::string String::format(long number, unsigned char base)
+{
+  if (number < 0 && base == DEC)
+  {
+    return "-" + format((unsigned long)-number, base);
+  }
+  return format((unsigned long)number, base);
+}
+
+std::string String::format(unsigned long number, unsigned char base)
+{
+  if (base < 2 || base > 16)
+  {
+    base = DEC;
+  }
+
+  std::string digits;
+  do
+  {
+    digits.insert(digits.begin(), "0123456789ABCDEF"[number % base]);
+    number /= base;
+  } while (number);
+  return digits;
+}
+
+void String::toLowerCase()
+{
+  for (char &c : value)
+  {
+    c = tolower(c);
+  }
+}
+
+void String::trim()
+{
+  const size_t first = value.find_first_not_of(" \t\r\n");
+  const size_t last = value.find_last_not_of(" \t\r\n");
+  value = first == std::string::npos ? "" : value.substr(first, last - first + 1);
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  size_t written = 0;
+  while (size--)
+  {
+    written += write(*buffer++);
+  }
+  return written;
+}
+
+size_t Print::printf(const char *format, ...)
+{
+  char buffer[256];
+  va_list arguments;
+  va_start(arguments, format);
+  const int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+  va_end(arguments);
+  return length > 0 ? write((const uint8_t *)buffer, std::min((size_t)length, sizeof(buffer) - 1)) : 0;
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+  size_t count = 0;
+  while (count < length && available() > 0)
+  {
+    buffer[count++] = read();
+  }
+  return count;
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  return fwrite(&c, 1, 1, stdout);
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+  return fwrite(buffer, 1, size, stdout);
+}
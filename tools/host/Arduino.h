@@ -0,0 +1,197 @@
+// Just enough of the ESP8266 Arduino core to build src/ and its libraries on the host, for the benchmarks in tools/.
+// Hardware calls are no-ops, time is the host's, Serial goes to stdout.
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define PGM_P const char *
+#define PSTR(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_byte_near(address) pgm_read_byte(address)
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define pgm_read_dword(address) (*(const uint32_t *)(address))
+#define pgm_read_ptr(address) (*(void *const *)(address))
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define RISING 1
+#define D1 5
+#define D2 4
+#define SS 15
+#define MISO 12
+#define HEX 16
+#define DEC 10
+
+#define highByte(w) ((uint8_t)((w) >> 8))
+#define lowByte(w) ((uint8_t)((w)&0xff))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+using std::max;
+using std::min;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+long random(long howBig);
+long random(long howSmall, long howBig);
+void randomSeed(unsigned long seed);
+
+inline void pinMode(uint8_t, uint8_t) {}
+inline void digitalWrite(uint8_t, uint8_t) {}
+inline int digitalRead(uint8_t) { return LOW; }
+inline void attachInterrupt(uint8_t, void (*)(void), int) {}
+inline void configTime(const char *, const char *, const char * = nullptr, const char * = nullptr) {}
+
+#if !defined(__GLIBC__) || !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *destination, const char *source, size_t size);
+#endif
+
+class String
+{
+public:
+  String(const char *value = "") : value(value ? value : "") {}
+  String(const std::string &value) : value(value) {}
+  String(char c) : value(1, c) {}
+  String(int value, unsigned char base = DEC) : value(format(value, base)) {}
+  String(unsigned int value, unsigned char base = DEC) : value(format(value, base)) {}
+  String(long value, unsigned char base = DEC) : value(format(value, base)) {}
+  String(unsigned long value, unsigned char base = DEC) : value(format(value, base)) {}
+  String(double value, unsigned char decimals = 2);
+
+  String &operator+=(const String &other) { value += other.value; return *this; }
+  String &operator+=(const char *other) { value += other; return *this; }
+  String &operator+=(char c) { value += c; return *this; }
+  String &operator+=(int number) { value += format(number, DEC); return *this; }
+  bool concat(const char *other) { value += other; return true; }
+  bool concat(char c) { value += c; return true; }
+
+  bool operator==(const String &other) const { return value == other.value; }
+  bool operator==(const char *other) const { return value == other; }
+  bool operator!=(const String &other) const { return value != other.value; }
+  bool operator!=(const char *other) const { return value != other; }
+  char operator[](unsigned int index) const { return index < value.size() ? value[index] : 0; }
+
+  const char *c_str() const { return value.c_str(); }
+  unsigned int length() const { return value.size(); }
+  bool reserve(unsigned int size) { value.reserve(size); return true; }
+  String substring(unsigned int from) const { return from < value.size() ? String(value.substr(from)) : String(); }
+  String substring(unsigned int from, unsigned int to) const { return from < to && from < value.size() ? String(value.substr(from, to - from)) : String(); }
+  int indexOf(char c) const { return value.find(c) == std::string::npos ? -1 : (int)value.find(c); }
+  int indexOf(const char *other) const { return value.find(other) == std::string::npos ? -1 : (int)value.find(other); }
+  bool startsWith(const String &prefix) const { return value.compare(0, prefix.value.size(), prefix.value) == 0; }
+  bool endsWith(const String &suffix) const { return value.size() >= suffix.value.size() && value.compare(value.size() - suffix.value.size(), suffix.value.size(), suffix.value) == 0; }
+  long toInt() const { return atol(value.c_str()); }
+  float toFloat() const { return atof(value.c_str()); }
+  void toLowerCase();
+  void trim();
+
+private:
+  static std::string format(long number, unsigned char base);
+  static std::string format(unsigned long number, unsigned char base);
+  static std::string format(int number, unsigned char base) { return format((long)number, base); }
+  static std::string format(unsigned int number, unsigned char base) { return format((unsigned long)number, base); }
+
+  std::string value;
+};
+
+class StringSumHelper : public String
+{
+public:
+  StringSumHelper(const String &value) : String(value) {}
+};
+
+inline StringSumHelper operator+(const String &left, const String &right) { String sum(left); sum += right; return sum; }
+inline StringSumHelper operator+(const String &left, const char *right) { String sum(left); sum += right; return sum; }
+inline StringSumHelper operator+(const char *left, const String &right) { String sum(left); sum += right; return sum; }
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *text) { return text ? write((const uint8_t *)text, strlen(text)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  virtual void flush() {}
+
+  size_t print(const char *text) { return write(text); }
+  size_t print(const String &text) { return write(text.c_str()); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int number, int base = DEC) { return print(String(number, base)); }
+  size_t print(unsigned int number, int base = DEC) { return print(String(number, base)); }
+  size_t print(long number, int base = DEC) { return print(String(number, base)); }
+  size_t print(unsigned long number, int base = DEC) { return print(String(number, base)); }
+  size_t print(double number, int decimals = 2) { return print(String(number, decimals)); }
+  size_t println() { return write("\r\n"); }
+  template <typename T>
+  size_t println(const T &value) { return print(value) + println(); }
+  template <typename T>
+  size_t println(T value, int format) { return print(value, format) + println(); }
+  size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  size_t readBytes(char *buffer, size_t length);
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+  void setTimeout(unsigned long) {}
+};
+
+class HardwareSerial : public Stream
+{
+public:
+  void begin(unsigned long) {}
+  size_t write(uint8_t c) override;
+  size_t write(const uint8_t *buffer, size_t size) override;
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  int peek() override { return -1; }
+};
+
+extern HardwareSerial Serial;
+
+class EspClass
+{
+public:
+  void reset() { exit(0); }
+  void restart() { exit(0); }
+  uint32_t getFreeHeap() { return 0; }
+  uint8_t getHeapFragmentation() { return 0; }
+  uint32_t getMaxFreeBlockSize() { return 0; }
+  uint32_t getCycleCount() { return micros(); }
+};
+
+extern EspClass ESP;
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HOST_ARDUINO_OTA_H
+#define HOST_ARDUINO_OTA_H
+
+class ArduinoOTAClass
+{
+public:
+  void begin() {}
+  void handle() {}
+  void setHostname(const char *) {}
+};
+
+extern ArduinoOTAClass ArduinoOTA;
+
+#endif
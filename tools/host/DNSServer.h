@@ -0,0 +1,3 @@
+#ifndef HOST_DNS_SERVER_H
+#define HOST_DNS_SERVER_H
+#endif
@@ -0,0 +1,110 @@
+#ifndef HOST_ESP8266_WIFI_H
+#define HOST_ESP8266_WIFI_H
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include "Arduino.h"
+#include "Client.h"
+#include "IPAddress.h"
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+typedef int wl_status_t;
+
+enum WiFiMode_t
+{
+  WIFI_OFF,
+  WIFI_STA,
+  WIFI_AP,
+  WIFI_AP_STA
+};
+
+struct WiFiEventStationModeGotIP
+{
+  IPAddress ip;
+};
+
+struct WiFiEventStationModeDisconnected
+{
+  String ssid;
+  uint8_t reason;
+};
+
+struct WiFiEventStationModeConnected
+{
+  String ssid;
+};
+
+class WiFiEventHandlerOpaque
+{
+};
+typedef std::shared_ptr<WiFiEventHandlerOpaque> WiFiEventHandler;
+
+// Stands in for the TCP socket: counts what is written, hands out what was queued with receive()
+class WiFiClient : public Client
+{
+public:
+  int connect(IPAddress, uint16_t) override { return open = true; }
+  int connect(const char *, uint16_t) override { return open = true; }
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *, size_t size) override
+  {
+    if (!open)
+    {
+      return 0;
+    }
+    written += size;
+    return size;
+  }
+  int available() override { return incoming.size() - position; }
+  int read() override { return available() > 0 ? incoming[position++] : -1; }
+  int read(uint8_t *buffer, size_t size) override
+  {
+    size_t count = 0;
+    while (count < size && available() > 0)
+    {
+      buffer[count++] = incoming[position++];
+    }
+    return count;
+  }
+  int peek() override { return available() > 0 ? incoming[position] : -1; }
+  void flush() override {}
+  void stop() override { open = false; }
+  uint8_t connected() override { return open; }
+  operator bool() override { return open; }
+  void setTimeout(unsigned long) {}
+  void setNoDelay(bool) {}
+
+  void receive(const uint8_t *data, size_t size) { incoming.insert(incoming.end(), data, data + size); }
+
+  size_t written = 0;
+
+private:
+  bool open = false;
+  std::vector<uint8_t> incoming;
+  size_t position = 0;
+};
+
+class ESP8266WiFiClass
+{
+public:
+  wl_status_t status() { return WL_CONNECTED; }
+  bool isConnected() { return true; }
+  bool softAPdisconnect(bool) { return true; }
+  bool hostname(const char *) { return true; }
+  IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+  wl_status_t begin(const char *, const char *) { return WL_CONNECTED; }
+  bool mode(WiFiMode_t) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  bool reconnect() { return true; }
+  bool persistent(bool) { return true; }
+  int32_t RSSI() { return 0; }
+  WiFiEventHandler onStationModeGotIP(std::function<void(const WiFiEventStationModeGotIP &)>) { return WiFiEventHandler(); }
+  WiFiEventHandler onStationModeDisconnected(std::function<void(const WiFiEventStationModeDisconnected &)>) { return WiFiEventHandler(); }
+  WiFiEventHandler onStationModeConnected(std::function<void(const WiFiEventStationModeConnected &)>) { return WiFiEventHandler(); }
+};
+
+extern ESP8266WiFiClass WiFi;
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef HOST_ESP8266_MDNS_H
+#define HOST_ESP8266_MDNS_H
+
+class MDNSResponder
+{
+public:
+  bool begin(const char *) { return true; }
+  void update() {}
+};
+
+extern MDNSResponder MDNS;
+
+#endif
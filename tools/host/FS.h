@@ -0,0 +1,57 @@
+#ifndef HOST_FS_H
+#define HOST_FS_H
+
+#include "Arduino.h"
+
+enum SeekMode
+{
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+// No flash on the host, every file is missing
+class File : public Stream
+{
+public:
+  size_t write(uint8_t) override { return 0; }
+  size_t write(const uint8_t *, size_t) override { return 0; }
+  using Print::write;
+  int available() override { return 0; }
+  int read() override { return -1; }
+  size_t read(uint8_t *, size_t) { return 0; }
+  int peek() override { return -1; }
+  bool seek(uint32_t, SeekMode = SeekSet) { return false; }
+  size_t position() const { return 0; }
+  size_t size() const { return 0; }
+  void close() {}
+  operator bool() const { return false; }
+  const char *name() const { return ""; }
+};
+
+class Dir
+{
+public:
+  bool next() { return false; }
+  String fileName() { return String(); }
+  size_t fileSize() { return 0; }
+  File openFile(const char *) { return File(); }
+};
+
+class FS
+{
+public:
+  bool begin() { return true; }
+  bool format() { return true; }
+  File open(const char *, const char *) { return File(); }
+  File open(const String &, const char *) { return File(); }
+  Dir openDir(const char *) { return Dir(); }
+  bool exists(const char *) { return false; }
+  bool exists(const String &) { return false; }
+  bool remove(const char *) { return false; }
+  bool remove(const String &) { return false; }
+};
+
+extern FS SPIFFS;
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef HOST_IPADDRESS_H
+#define HOST_IPADDRESS_H
+
+#include "Arduino.h"
+#include "lwip/dns.h"
+
+class IPAddress
+{
+public:
+  IPAddress() : address(0) {}
+  IPAddress(uint32_t address) : address(address) {}
+  IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth)
+      : address(first | second << 8 | third << 16 | (uint32_t)fourth << 24) {}
+  IPAddress(const uint8_t *bytes) : IPAddress(bytes[0], bytes[1], bytes[2], bytes[3]) {}
+  IPAddress(const ip_addr_t *from) : address(from->addr) {}
+
+  operator uint32_t() const { return address; }
+  uint8_t operator[](int index) const { return address >> (index * 8); }
+  bool isSet() const { return address != 0; }
+  String toString() const
+  {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", (*this)[0], (*this)[1], (*this)[2], (*this)[3]);
+    return String(text);
+  }
+
+private:
+  uint32_t address;
+};
+
+#endif
@@ -0,0 +1,2 @@
+// The benchmarks don't touch Wi-Fi or the broker, the sample settings do
+#include "configuration_sample.h"
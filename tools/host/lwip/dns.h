@@ -0,0 +1,25 @@
+#ifndef HOST_LWIP_DNS_H
+#define HOST_LWIP_DNS_H
+
+#include <stdint.h>
+
+typedef signed char err_t;
+typedef struct ip_addr
+{
+  uint32_t addr;
+} ip_addr_t;
+
+#define ERR_OK 0
+#define ERR_INPROGRESS -5
+#define ERR_ARG -16
+
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *ipaddr, void *callback_arg);
+
+// Every name resolves to 127.0.0.1 right away
+inline err_t dns_gethostbyname(const char *, ip_addr_t *addr, dns_found_callback, void *)
+{
+  addr->addr = 0x0100007F;
+  return ERR_OK;
+}
+
+#endif
@@ -0,0 +1,80 @@
+// Encode time and size of the device state document, JSON against MessagePack, on the host.
+//
+//     pio pkg install   # fetches ArduinoJson into .pio/libdeps
+//     make -C tools payload_benchmark
+//     tools/payload_benchmark
+//
+// The documents come from buildStateDocument() in src/main.cpp for a heating and a wall thermostat. Times are the
+// host's, only the ratio carries over to the bridge.
+
+#include <chrono>
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include "max.h"
+#include "state.h"
+#include "device_pool.hpp"
+#include "string_pool.hpp"
+#include "main.hpp"
+
+#define ROUNDS 200000
+
+const int capacity = JSON_OBJECT_SIZE(12) + 256; // As in main.cpp
+
+template <typename Encode>
+double nanosPerEncode(Encode encode)
+{
+  char buffer[256];
+  volatile size_t sink = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < ROUNDS; i++)
+  {
+    sink += encode(buffer, sizeof(buffer));
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ROUNDS;
+}
+
+void compare(const char *name, state *device)
+{
+  StaticJsonDocument<capacity> doc;
+  buildStateDocument(device, doc);
+
+  const double json = nanosPerEncode([&](char *buffer, size_t size) { return serializeJson(doc, buffer, size); });
+  const double msgpack = nanosPerEncode([&](char *buffer, size_t size) { return serializeMsgPack(doc, buffer, size); });
+
+  printf("%-12s json    %4u bytes %8.0f ns\n", name, (unsigned)measureJson(doc), json);
+  printf("%-12s msgpack %4u bytes %8.0f ns\n", name, (unsigned)measureMsgPack(doc), msgpack);
+}
+
+int main()
+{
+  state *heater = &states[states.add()];
+  heater->type = DEVICE_HEATING_THERMOSTAT;
+  heater->mode = MODE_AUTO;
+  heater->room = internString("living-room");
+  heater->measured_temperature = 215;
+  heater->desired_temperature = 42;
+  heater->valve_position = 37;
+  heater->low_battery = false;
+  heater->rf_error = false;
+  heater->rssi = -71;
+  heater->frames_received = 987;
+  heater->frames_lost = 13;
+  compare("heater", heater);
+
+  state *thermostat = &states[states.add()];
+  thermostat->type = DEVICE_WALL_THERMOSTAT;
+  thermostat->mode = MODE_MANUAL;
+  thermostat->room = internString("living-room");
+  thermostat->measured_temperature = 208;
+  thermostat->desired_temperature = 43;
+  thermostat->low_battery = false;
+  thermostat->rf_error = false;
+  thermostat->rssi = -64;
+  thermostat->frames_received = 1000;
+  compare("thermostat", thermostat);
+
+  return 0;
+}
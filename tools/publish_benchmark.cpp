@@ -0,0 +1,91 @@
+// Device state publish, buffered as before against streamed through publishDocument(), on the host.
+//
+//     make -C tools publish_benchmark
+//     tools/publish_benchmark
+//
+// Both publish the state document of a named heating thermostat through the real PubSubClient, connected with a
+// scripted CONNACK, to a socket that only counts bytes. Buffered serializes into a 256 byte stack buffer, builds the
+// topic in a heap String and lets publish() copy both into the client buffer. Streamed is publishDocument() with the
+// topic from deviceTopic(). Times are the host's, heap and socket calls cost more on the bridge. publishes and
+// publish_us on max/diagnostics give the real numbers there.
+
+#include <chrono>
+#include "Arduino.h"
+#include <ArduinoJson.h>
+#include <PubSubClient.h>
+#include "max.h"
+#include "state.h"
+#include "device_pool.hpp"
+#include "string_pool.hpp"
+#include "main.hpp"
+#include "mqtt.hpp"
+
+#define ROUNDS 500000
+
+extern byte mqtt_step;
+
+const int capacity = JSON_OBJECT_SIZE(12) + 256; // As in main.cpp
+
+template <typename Publish>
+double nanosPerPublish(Publish publish)
+{
+  volatile long sink = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < ROUNDS; i++)
+  {
+    sink += publish();
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ROUNDS;
+}
+
+int main()
+{
+  Debug.muted = true;
+
+  const byte connack[] = {0x20, 0x02, 0x00, 0x00};
+  espClient.receive(connack, sizeof(connack));
+  if (!client.connect("benchmark"))
+  {
+    printf("No CONNACK\n");
+    return 1;
+  }
+  mqtt_step = MQTT_READY;
+
+  state *device = &states[states.add()];
+  device->type = DEVICE_HEATING_THERMOSTAT;
+  device->mode = MODE_AUTO;
+  device->room = internString("living-room");
+  device->measured_temperature = 215;
+  device->desired_temperature = 42;
+  device->valve_position = 37;
+  device->low_battery = false;
+  device->rf_error = false;
+  device->rssi = -71;
+  device->frames_received = 987;
+  device->frames_lost = 13;
+  nameDevice(device, "living-room/heater");
+
+  const double buffered = nanosPerPublish([&]() {
+    StaticJsonDocument<capacity> doc;
+    buildStateDocument(device, doc);
+    char payload[256];
+    serializeJson(doc, payload);
+    return client.publish((String("max/") + pooledString(device->name)).c_str(), payload, true);
+  });
+
+  const double streamed = nanosPerPublish([&]() {
+    char topic[MQTT_TOPIC_MAX];
+    StaticJsonDocument<capacity> doc;
+    buildStateDocument(device, doc);
+    return publishDocument(deviceTopic(topic, device, ""), doc, true, PAYLOAD_JSON);
+  });
+
+  printf("buffered  %8.1f ns\n", buffered);
+  printf("streamed  %8.1f ns\n", streamed);
+  printf("sent      %8u bytes\n", (unsigned)espClient.written);
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""Replay recorded radio traffic through a max2mqtt bridge.
+
+Frames are fed to max/replay, where the bridge runs them through handle(), the
+TX queue and isHeatingNeeded() on a virtual clock without touching the radio,
+the burner relay or retained device topics. The replay has its own copy of the
+device records, live frames, commands and heating carry on between batches.
+
+Input is a capture file (see capture.py) or a text dump with one hex frame per
+line, e.g. the "Received message, ..." lines of the serial log. Text lines may
+start with a timestamp in seconds or HH:MM:SS[.mmm]; otherwise --interval apart.
+
+    ./tools/replay.py -H mqtt.lan evening.bin
+
+--synthetic N generates thermostat state frames from N made up addresses
+instead, to measure how handle() scales with the size of the device registry.
+Needs autocreate, the made up devices are dropped with the rest of the replay.
+Each takes a few hundred bytes of heap counting history and the replay's own
+copy of the records, so N beyond 50 or so runs out of memory. Larger
+registries are covered by tools/device_index_benchmark.cpp on the host.
+
+    ./tools/replay.py -H mqtt.lan --synthetic 50
+"""
+
+import argparse
+import json
+import re
+import struct
+import subprocess
+import sys
+import time
+
+import capture
+
+BATCH_SIZE = 200  # Must fit into bridge's PubSubClient buffer with topic
+HEX_FRAME = re.compile(r"\b([0-9A-Fa-f]{22,})\b")
+CLOCK_PREFIX = re.compile(r"^\s*(?:(\d+):(\d+):(\d+(?:\.\d+)?)|(\d+(?:\.\d+)?))\b")
+
+
+def record(millis, rssi, lqi, frame):
+    flags = 0  # Received, result is decided by the bridge again
+    data = bytes([capture.MAGIC]) + struct.pack("<BIbBB", flags, millis & 0xFFFFFFFF, rssi, lqi, len(frame)) + frame
+    return data + bytes([sum(data) & 0xFF])
+
+
+def frames_from_text(text, interval):
+    millis = 0
+    for line in text.splitlines():
+        match = HEX_FRAME.search(line)
+        if not match:
+            continue
+
+        clock = CLOCK_PREFIX.match(line)
+        if clock and clock.group(4):
+            millis = int(float(clock.group(4)) * 1000)
+        elif clock:
+            millis = int((int(clock.group(1)) * 3600 + int(clock.group(2)) * 60 + float(clock.group(3))) * 1000)
+        else:
+            millis += interval
+
+        frame = bytes.fromhex(match.group(1))
+        rssi, lqi = -60, 0x80
+        # Serial log shows the frame with CC1101 status bytes appended
+        if len(frame) == frame[0] + 3:
+            raw = frame[-2]
+            rssi = (raw - 256) // 2 - 74 if raw >= 128 else raw // 2 - 74
+            lqi = frame[-1]
+            frame = frame[:-2]
+        yield record(millis, rssi, lqi, frame)
+
+
+def frames_synthetic(devices, rounds, interval):
+    millis = 0
+    for count in range(rounds):
+        for device in range(devices):
+            address = (0xA00000 + device).to_bytes(3, "big")
+            # Heating thermostat state, auto mode, 21 degree desired, 21.0 measured
+            frame = bytes([0x0F, count & 0xFF, 0x04, 0x60]) + address + bytes([0, 0, 0, 0, 0x18, 20, 42, 0x00, 0xD2])
+            yield record(millis, -60, 0x80, frame)
+            millis += interval
+
+
+def frames_from_capture(data):
+    for entry in capture.parse(capture.linearize(data)):
+        if not entry.is_tx and not entry.is_clock:
+            yield record(entry.millis, entry.rssi, entry.lqi, entry.frame)
+
+
+def load(path, interval):
+    with open(path, "rb") as file:
+        data = file.read()
+
+    records = list(frames_from_capture(data))
+    if records:
+        return records
+    return list(frames_from_text(data.decode("utf-8", "replace"), interval))
+
+
+def batches(records):
+    batch = b""
+    for entry in records:
+        if len(batch) + len(entry) > BATCH_SIZE:
+            yield batch
+            batch = b""
+        batch += entry
+    if batch:
+        yield batch
+
+
+def publish(host, topic, payload):
+    subprocess.run(["mosquitto_pub", "-h", host, "-q", "1", "-t", topic, "-s"], input=payload, check=True)
+
+
+def print_report(report):
+    cpu = report["cpu_us"]
+    print("Frames:         %i received, %i sent" % (report["frames"], report["sent"]))
+    print("Virtual time:   %i s, replayed in %i ms" % (report["virtual_s"], report["wall_ms"]))
+    print("Throughput:     %.0f frames/s" % report["fps"])
+    print("CPU:            handle %i us, queue %i us, heating %i us" % (cpu["handle"], cpu["queue"], cpu["heating"]))
+    if report["frames"]:
+        print("Per frame:      handle %.1f us" % (cpu["handle"] / report["frames"]))
+    print("Burner:         %i switches" % report["burner_switches"])
+    queue = report["queue"]
+    print("Queue depth:    max %i, every %i s: %s" % (queue["max"], queue["interval_s"], " ".join(str(depth) for depth in queue["depth"])))
+    print("Devices:")
+    for name, device in sorted(report["devices"].items()):
+        print("  %-32s %s" % (name, json.dumps(device, sort_keys=True)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("paths", nargs="*", metavar="FILE")
+    parser.add_argument("-H", "--host", default="mqtt.lan", help="MQTT broker")
+    parser.add_argument("--interval", type=int, default=1000, help="ms between untimed text frames")
+    parser.add_argument("--synthetic", type=int, metavar="N", help="generate frames from N devices instead")
+    parser.add_argument("--rounds", type=int, default=10, help="frames per synthetic device")
+    parser.add_argument("--timeout", type=int, default=120, help="seconds to wait for the report")
+    parser.add_argument("--json", action="store_true", help="print raw report")
+    args = parser.parse_args()
+
+    records = []
+    if args.synthetic:
+        records.extend(frames_synthetic(args.synthetic, args.rounds, args.interval))
+    for path in args.paths:
+        records.extend(load(path, args.interval))
+    if not records:
+        sys.exit("No frames found.")
+
+    # Subscribe before feeding, the report comes right after max/replay/end
+    report = subprocess.Popen(["mosquitto_sub", "-h", args.host, "-t", "max/replay/report", "-C", "1", "-W", str(args.timeout)],
+                              stdout=subprocess.PIPE)
+    time.sleep(0.5)
+
+    for batch in batches(records):
+        publish(args.host, "max/replay", batch)
+    publish(args.host, "max/replay/end", b"")
+
+    output, _ = report.communicate()
+    if not output:
+        sys.exit("No report received.")
+
+    result = json.loads(output)
+    if args.json:
+        print(json.dumps(result, indent=2))
+    else:
+        print_report(result)
+
+
+if __name__ == "__main__":
+    main()
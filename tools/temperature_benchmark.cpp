@@ -0,0 +1,92 @@
+// Frame handling cost of temperatures as float against fixed point tenths, on the host.
+//
+//     make -C tools temperature_benchmark
+//     tools/temperature_benchmark
+//
+// Each round decodes a measured temperature and a set point as handle() does, runs the publish deadband and the
+// heating comparison and formats both for the log. Fixed point uses compareTemperature(), exceedsDeadband() and the
+// macros of state.h, float is the code they replaced. The host has an FPU, the ESP8266 emulates float in software,
+// so the gap on the bridge is wider than shown here.
+
+#include <chrono>
+#include "Arduino.h"
+#include "state.h"
+#include "main.hpp"
+
+#define ROUNDS 2000000
+
+// Not in a header, private to main.cpp
+int compareTemperature(temperature_t measured_temperature, temperature_t desired_temperature);
+bool exceedsDeadband(int value, int published, int deadband);
+
+// Set point in half degrees shifted left, measured tenths in the low bit and next byte, first 21.5 measured at 21.0 set
+static const uint8_t frames[4][2] = {{0x54, 0xd7}, {0x54, 0xd2}, {0x50, 0xcd}, {0x56, 0xe1}};
+
+// Run 1, keep 0, stop -1 as in main.cpp
+int compareFloat(float measured, float desired)
+{
+  if (measured <= desired - 0.4f)
+  {
+    return 1;
+  }
+  if (measured >= desired - 0.2f)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+template <typename Round>
+double nanosPerRound(Round round)
+{
+  char line[64];
+  volatile long sink = 0;
+
+  const auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < ROUNDS; i++)
+  {
+    sink += round(frames[i & 3], line, sizeof(line));
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+
+  return std::chrono::duration<double, std::nano>(elapsed).count() / ROUNDS;
+}
+
+int main()
+{
+  float publishedFloat = 0;
+  temperature_t publishedFixed = 0;
+
+  const double asFloat = nanosPerRound([&](const uint8_t *frame, char *line, size_t size) {
+    const float measured = (((frame[0] & 0x01) << 8) + frame[1]) / 10.0f;
+    const float desired = (frame[0] >> 1) / 2.0f;
+    long result = compareFloat(measured, desired);
+    if (measured - publishedFloat >= 0.2f || publishedFloat - measured >= 0.2f)
+    {
+      publishedFloat = measured;
+      result++;
+    }
+    return result + snprintf(line, size, "%.1f %.1f", measured, desired);
+  });
+
+  const double asFixed = nanosPerRound([&](const uint8_t *frame, char *line, size_t size) {
+    const temperature_t measured = ((frame[0] & 0x01) << 8) + frame[1];
+    const temperature_t desired = HALVES_TO_TENTHS(frame[0] >> 1);
+    long result = compareTemperature(measured, desired);
+    if (exceedsDeadband(measured, publishedFixed, publish_deadband_temperature))
+    {
+      publishedFixed = measured;
+      result++;
+    }
+    return result + snprintf(line, size, TEMPERATURE_FORMAT " " TEMPERATURE_FORMAT, TEMPERATURE_ARGS(measured), TEMPERATURE_ARGS(desired));
+  });
+
+  char negative[16];
+  snprintf(negative, sizeof(negative), TEMPERATURE_FORMAT, TEMPERATURE_ARGS(-5));
+
+  printf("float        %8.1f ns\n", asFloat);
+  printf("fixed point  %8.1f ns\n", asFixed);
+  printf("-5 tenths    %s\n", negative);
+
+  return 0;
+}